@@ -9,20 +9,22 @@
 #define STRAWB_ALIGNMENTS_H_
 
 #include <list>
+#include <array>
 #include <map>
+#include <set>
 #include <climits>
 #include <atomic>
 #include "read.hpp"
 #include "contig.h"
 #include "gff.h"
 #include "isoform.h"
+#include "spill.h"
 
 class Sample;
 
 class FaInterface;
 
 class FaSeqGetter;
-using IntronMap = std::map<std::pair<uint, uint>, IntronTable>;
 
 struct Segment {
    uint left;
@@ -47,13 +49,17 @@ private:
     RefID _ref_id = -1;
     bool _final; // HitCluster is finished
     double _raw_mass = 0.0;
-    std::unordered_map<ReadID, std::list<PairedHit>> _open_mates;
+    // open mates waiting for their partner; nearly always one per read id
+    FlatHashMap<ReadID, SmallVector<PairedHit, 1>> _open_mates;
+    // distinct fragments, each carrying the count and mass of its copies; freed once collapsed
     std::vector<PairedHit> _hits;
+    FlatHashMap<PairedHit, size_t, PairedHitHash> _hit_index; // position of each fragment in _hits
     std::vector<PairedHit> _uniq_hits;
     std::vector<int> _read_ref_span;
     std::vector<Contig> _ref_mRNAs; // the actually objects are owned by Sample
     std::vector<GenomicFeature> _introns;
     std::vector<float> _dep_of_cov;
+    std::vector<std::shared_ptr<ReadHitArena>> _arenas; // front() owns the hits read into this cluster
 
     void reweight_read(const std::unordered_map<std::string, double> &kmer_bias, int num_kmers);
 
@@ -61,7 +67,8 @@ private:
     //map<std::pair<int,int>,int> _current_intron_counter;
 public:
     std::vector<Segment> _segs;
-    std::map<Strand_t, std::map<GenomicFeature, int>> _strand_intron;
+    // spliced reads per intron (see intron_key()), indexed by Strand_t
+    std::array<FlatHashMap<uint64_t, int>, 4> _strand_intron;
     decltype(auto) uniq_hits() const { return (_uniq_hits);}
     decltype(auto) id() const { return (_id);}
     double _weighted_mass = 0.0;
@@ -116,10 +123,19 @@ public:
 
     void refine_cluster();
 
+    ReadHitPtr keep(ReadHit &&hit) {
+        return _arenas.front()->keep(std::move(hit));
+    }
+
     bool addOpenHit(const ReadHitPtr hit, bool extend_by_hit, bool extend_by_partner);
 
     int collapseAndFilterHits();
 
+    int downsampleHits(size_t max_frags);
+
+    // Approximate bytes held by the cluster, for --max-memory.
+    size_t mem_size() const;
+
     bool overlaps(const HitCluster &rhs) const;
 
     bool hasRefmRNAs() const {
@@ -175,6 +191,28 @@ public:
 };
 
 class LocusContext;
+
+/*
+ * Fragments of a locus as printed in the fragment context: for each set of
+ * exon bins and ids of compatible transcripts, the number of fragments and
+ * the index of the last one.
+ */
+typedef std::map<std::pair<std::set<std::pair<uint,uint>>, std::vector<int>>, std::pair<uint, size_t>> FragClasses;
+
+/*
+ * A locus whose fragments have been assigned to exon bins but whose
+ * abundances are not estimated yet. Used by the single-pass workflow.
+ */
+struct PendingLocus {
+   RefID ref_id;
+   uint left;
+   uint right;
+   std::shared_ptr<LocusContext> est;
+   FragClasses frag_classes; // only kept when fragment context is printed
+   PendingLocus(RefID id, uint l, uint r, std::shared_ptr<LocusContext> e):
+         ref_id(id), left(l), right(r), est(move(e)) {}
+};
+
 class Sample {
     std::atomic<int> _num_cluster;
     //uint _prev_pos = 0;
@@ -184,22 +222,27 @@ class Sample {
     bool _has_load_all_refs;
     std::string _current_chrom;
     std::atomic_int _total_mapped_reads = {0};
+    bool _parallel_clusters; // one worker thread per cluster; off within a shard
+    std::unique_ptr<ReadTable> _shard_reads; // reads table owned by a shard
+
+    std::unique_ptr<Sample> makeShard(BAMHitFactory &whole_file, int tid) const;
 
 
 public:
     std::shared_ptr<HitFactory> _hit_factory;
     std::shared_ptr<InsertSize> _insert_size_dist = nullptr;
-    std::shared_ptr<FaSeqGetter> _fasta_getter = nullptr;
     std::shared_ptr<FaInterface> _fasta_interface = nullptr;
 
     std::unordered_map<std::string, double> _kmer_bias;
 
     std::vector<Contig> _ref_mRNAs; // sort by seq_id in reference_table
-    std::vector<Contig> _assembly;
+    SpillVector<Contig> _assembly;
+    std::vector<PendingLocus> _pending_loci;
 
     Sample(std::shared_ptr<HitFactory> hit_fac) :
             _refmRNA_offset(0),
             _has_load_all_refs(false),
+            _parallel_clusters(use_threads),
             _hit_factory(move(hit_fac)) {
     }
 
@@ -211,12 +254,13 @@ public:
     }
 
     std::string sample_name() const {
+        if (sample_path() == "-") return "stdin";
         std::vector<std::string> fields;
         split(fileName(sample_path()), ".", fields);
         return fields.front();
     }
 
-    bool load_chrom_fasta(RefID seq_id);
+    std::shared_ptr<FaSeqGetter> fasta_getter(RefID seq_id) const;
 
     std::string get_iso_seq(const std::shared_ptr<FaSeqGetter> &fa_getter, const Contig iso) const;
 
@@ -226,7 +270,7 @@ public:
 
     bool loadRefFasta(RefSeqTable &rt, const char *seqFile = NULL);
 
-    bool loadRefmRNAs(std::vector<std::unique_ptr<GffTree>> &gseqs, RefSeqTable &rt);
+    bool loadRefmRNAs(std::vector<AnnotatedSeq> &gseqs, RefSeqTable &rt);
 
     int addRef2Cluster(HitCluster &clusterOut);
 
@@ -234,7 +278,7 @@ public:
 
     double next_valid_alignment(ReadHit &readin);
 
-    void rewindHit();
+    void rewindHit(ReadHit &&hit);
     void rewindHits(uint64_t pos);
 
     int nextCluster_denovo(HitCluster &clusterOut,
@@ -250,18 +294,29 @@ public:
     void mergeClusters(HitCluster &dest, HitCluster &resource);
 
     //void compute_doc_4_cluster(const HitCluster & hit_cluster, std::vector<float> &exon_doc,
-    //map<std::pair<uint,uint>,IntronTable>& intron_counter, uint &small_overhang);
+    //IntronMap& intron_counter, uint &small_overhang);
     std::vector<Isoform> quantifyCluster(const RefSeqTable &ref_t, const std::shared_ptr<HitCluster> cluster,
                          const std::vector<Contig> &assembled_transcripts, FILE* plogfile, FILE* fragfile) const;
 
 
     void procSample(FILE *f, FILE *log, FILE* fragfile);
+    SpillVector<Isoform> quantifySample(FILE *log, FILE* fragfile);
+
+    bool loadBamIndex();
+    void assembleShards(FILE *log);
+    void procShards(FILE *f, FILE *log, FILE* fragfile);
+
+    void streamSample(FILE *log, bool keep_frags);
+    void deferQuant(const std::shared_ptr<HitCluster> cluster, const std::vector<Contig> &transcripts,
+                    FILE *plogfile, bool keep_frags);
+    void procPendingLoci(FILE *f, FILE *log, FILE* fragfile);
 
     void assembleSample(FILE *log);
     void inspect_read_len();
+    bool inspectByIndex();
 
     std::vector<Contig> runFlowAlgorithm(const Strand_t& strand, const std::vector<Contig>& hits,
-                                      const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+                                      const IntronMap &intron_counter,
                                       const std::vector<GenomicFeature> &exons);
 
     std::vector<Contig> assembleCluster(const RefSeqTable &ref_t, std::shared_ptr<HitCluster> cluster, FILE *plogfile);
@@ -273,7 +328,7 @@ public:
     void fragLenDist(const RefSeqTable &ref_t, const std::vector<Contig> &isoforms,
                      const std::shared_ptr<HitCluster> cluster, FILE *plogfile);
     void preProcess(FILE *log);
-    void printContext(const LocusContext& est, const std::shared_ptr<HitCluster> cluster,
+    void printContext(const LocusContext& est, const FragClasses &frag_classes,
                       const std::shared_ptr<FaSeqGetter> & fa_getter, FILE *fragfile) const;
 };
 
@@ -0,0 +1,32 @@
+/*
+ * annotation_cache.h
+ *
+ * Binary cache of reference transcripts.
+ * The transcripts parsed from a gtf/gff3 file are written once, already
+ * reduced and sorted, so that later runs with the same annotation map this
+ * file instead of parsing the text and building the GffTree objects again.
+ */
+
+#ifndef ANNOTATION_CACHE_H_
+#define ANNOTATION_CACHE_H_
+
+#include <string>
+#include <vector>
+#include "gff.h"
+
+class AnnotationCache
+{
+public:
+   // Write gseqs, parsed from annotation_file, to cache_file_name.
+   static bool write(const std::vector<AnnotatedSeq> &gseqs,
+                     const std::string &annotation_file,
+                     const std::string &cache_file_name);
+   /*
+    * Read the transcripts back. Exit if the cache was not built from the
+    * current version of annotation_file.
+    */
+   static std::vector<AnnotatedSeq> read(const std::string &annotation_file,
+                                         const std::string &cache_file_name);
+};
+
+#endif /* ANNOTATION_CACHE_H_ */
@@ -56,26 +56,26 @@ public:
    Graph::Node _sink;
 //   void initGraph(const int &left,
 //           const std::vector<float> &exon_doc,
-//           const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+//           const IntronMap &intron_counter,
 //           const std::vector<size_t> &bad_introns,
 //           std::vector<GenomicFeature> &exons,
 //           Graph::NodeMap<const GenomicFeature*> &node2feat);
 
    static bool splicingGraph(const RefID & ref_id, const int &left, const std::vector<float> &exon_doc,
-         std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+         IntronMap &intron_counter,
          std::vector<GenomicFeature> &exons);
 
    bool createNetwork(
          const std::vector<Contig> &hits,
          const std::vector<GenomicFeature> &exons,
-         const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+         const IntronMap &intron_counter,
          Graph::NodeMap<const GenomicFeature*> &node_map,
          Graph::ArcMap<int> &cost_map,
          Graph::ArcMap<int> &min_flow_map,
          std::vector<std::vector<Graph::Arc>> &path_cstrs);
 
    void addWeight(const std::vector<Contig> &hits,
-         const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+         const IntronMap &intron_counter,
          const Graph::NodeMap<const GenomicFeature*> &node_map,
          Graph::ArcMap<int> &arc_map);
 
@@ -95,10 +95,10 @@ public:
    static void filter_exon_segs(const std::vector<std::pair<uint,uint>>& paired_bars,
                          std::list<std::pair<uint,uint>>& exon_boundaries);
    static void remove_low_cov_exon(const int cluster_left, const std::vector<float>& exon_doc,
-                                   const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+                                   const IntronMap &intron_counter,
                             std::list<std::pair<uint,uint>>& exon_boundaries);
    static void filter_intron(const std::vector<GenomicFeature> &exons,
-         std::map<std::pair<uint,uint>, IntronTable> &intron_counter);
+         IntronMap &intron_counter);
 };
 
 void compute_exon_doc(const int left, const std::vector<float>& exon_doc, std::vector<GenomicFeature>& exons);
@@ -0,0 +1,80 @@
+/*
+ * bgzf_reader.h
+ *
+ * Read-ahead BGZF decompression for BAMHitFactory.
+ * A reader thread pulls compressed blocks off the disk and a pool of
+ * helper threads inflates them into a ring of ready blocks, so the thread
+ * parsing BAM records only copies bytes. Offsets are BGZF virtual offsets
+ * (block address << 16 | offset within block), i.e. the same values
+ * bgzf_tell() returns, so positions can be stored and restored across
+ * the two readers.
+ */
+
+#ifndef BGZF_READER_H_
+#define BGZF_READER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "sam/bam.h"
+
+class BGZFReader{
+   struct Block{
+      enum State{ Loaded, Inflating, Ready };
+      int64_t _address = 0;
+      int64_t _next_address = 0;
+      int _length = 0; // uncompressed length; 0 for the EOF marker and end of file
+      State _state = Loaded;
+      std::vector<uint8_t> _comp;
+      std::vector<uint8_t> _data;
+   };
+   typedef std::shared_ptr<Block> BlockPtr;
+
+   int _fd;
+   int64_t _file_size;
+   size_t _capacity; // max number of blocks read ahead of the consumer
+
+   std::deque<BlockPtr> _ring;   // ordered by block address
+   std::vector<BlockPtr> _free_blocks;
+   int64_t _next_read;   // next block address for the reader thread
+   uint64_t _epoch = 0;  // bumped whenever the pipeline restarts after a far seek
+   bool _at_end = false; // the reader thread has reached the end of the file
+   bool _stop = false;
+
+   int64_t _addr = 0; // consumer position
+   int _offset = 0;
+   BlockPtr _cur;     // block at _addr once acquired; read without locking
+
+   std::mutex _lock;
+   std::condition_variable _block_loaded;
+   std::condition_variable _block_ready;
+   std::condition_variable _slot_free;
+   std::vector<std::thread> _threads;
+
+   void loader();
+   void inflater();
+   BlockPtr acquire(std::unique_lock<std::mutex> &lk);
+   void trim();
+   bool load_block(int64_t address, Block &b) const;
+   static bool inflate_block(Block &b);
+public:
+   BGZFReader(const std::string &bam_file_name, int num_inflaters);
+   ~BGZFReader();
+   BGZFReader(const BGZFReader&) = delete;
+   BGZFReader& operator=(const BGZFReader&) = delete;
+
+   int64_t tell() const {
+      return (_addr << 16) | _offset;
+   }
+   void seek(int64_t pos);
+   ssize_t read(void *data, ssize_t length);
+   int read_bam1(bam1_t *b);
+};
+
+#endif /* BGZF_READER_H_ */
@@ -18,11 +18,14 @@
 #include <algorithm>
 #include <numeric>
 #include <iostream>
+#include <functional>
+#include <atomic>
+#include "flat_containers.h"
 typedef void* pointer;
 typedef uint64_t ReadID;
 typedef int RefID;
 
-extern bool SINGLE_END_EXP;
+extern std::atomic<bool> SINGLE_END_EXP; // cleared by whichever reader (or shard) sees a paired hit first
 extern bool BIAS_CORRECTION;
  extern bool NO_LOGGING;
  extern int kMinMapQual;
@@ -41,6 +44,8 @@ extern bool enforce_ref_models;
 extern bool utilize_ref_models;
 extern bool no_assembly;
 extern bool no_quant;
+extern bool single_pass;
+extern bool shard_by_chrom;
 extern int kMinJuncSupport; // min number of spliced aligned reads for a valid intron
 extern int LongJuncLength;
 extern int kMinSupportForLongJunc;
@@ -54,6 +59,8 @@ extern int kMaxCoverGap1;
 extern int kMaxCoverGap2;
 extern int kMinReadForAssemb; // min number of reads for assembly
 extern int kMaxReadNum4RL;
+extern int kMaxFragsPerLocus; // cap on distinct fragments per locus, see HitCluster::downsampleHits()
+extern size_t kMaxMemory; // bytes, see --max-memory and spill.h
 //extern int kMinExonLen4FD;
 //extern int kMinExonCov4FD;
 //extern bool singleExon4FD;
@@ -72,6 +79,9 @@ extern std::string tracker;
 extern std::string ref_gtf_filename;
 extern std::string ref_fasta_file;
 extern std::string frag_context_out;
+extern std::string hit_cache_file;
+extern std::string genome_2bit_file;
+extern std::string gtf_cache_file;
 extern bool print_frag_context;
 extern bool effective_len_norm;
 extern float kIntronEdgeWeight;
@@ -134,6 +144,13 @@ inline double phi(double x)
 
 int fileExists(const char* fname);
 
+/*
+ * Canonical path of fname with its size and modification time, which the
+ * caches record to tell whether they were built from this file. Size and
+ * time are 0 if the file cannot be stat'ed.
+ */
+std::string fileIdentity(const std::string &fname, uint64_t &size, int64_t &mtime);
+
 inline int64_t fileSize(const char* fpath)
 {
    struct stat results;
@@ -240,6 +257,9 @@ float parseFloat(const char* optarg,
              void (*print_help)());
 int mkpath(const char *s, mode_t mode);
 
+// Run job(0) ... job(num_shards-1), on num_threads threads with -p.
+void run_shards(int num_shards, const std::function<void(int)> &job);
+
 //--------------------------------------------------------
 // ************** simple line reading class for text files
 class SlineReader {
@@ -575,6 +595,9 @@ struct IntronTable{
    }
 };
 
+// Introns of a locus keyed by (left, right), in genomic order.
+using IntronMap = FlatMap<std::pair<uint, uint>, IntronTable>;
+
 
 
 #endif /* COMMON_H_ */
@@ -22,6 +22,7 @@ class ReadHit;
 class RefSeqTable;
 class Contig;
 struct CigarOp;
+template<class T> struct SpillCodec;
 
 enum Match_t
 {
@@ -153,6 +154,7 @@ class Contig{
    std::string _ref_gene_name;
    double _mass = 0.0;
    SingleOrit_t _single_read_orit = SingleOrit_t::NotSingle;
+   friend struct SpillCodec<Contig>;
 
 public:
    bool _is_ref;
@@ -64,9 +64,6 @@ public:
                 const std::vector<Contig> &transcripts):
          _sample(s),  _p_log_file(tracker)
    {
-      assert(transcripts.size());
-      _read_len = _sample._hit_factory->_reads_table.read_len_mode();
-
       std::vector<Contig> hits;
       for (auto r = cluster->uniq_hits().cbegin(); r != cluster->uniq_hits().cend(); ++r) {
         Contig hit(*r);
@@ -74,9 +71,32 @@ public:
            hits.push_back(hit);
         }
         else {
-           fprintf(tracker, "paired reads %s and %s are not compatible\n", r->left_read_obj().read_name().c_str(), r->_right_read->read_name().c_str());
+           // read names are only kept in verbose mode
+           fprintf(tracker, "paired reads %s and %s at %d and %d are not compatible\n", r->left_read_obj().read_name().c_str(), r->_right_read->read_name().c_str(),
+                   r->_left_read->left(), r->_right_read->left());
         }
       }
+      init(hits, transcripts);
+      set_bin_weight();
+   }
+
+   /*
+    * Used by the single-pass workflow. Bin weights depend on the fragment length
+    * distribution, which is only known after the whole BAM has been streamed.
+    * Call set_bin_weight() before estimate_abundances().
+    */
+   LocusContext(const Sample& s,
+                FILE* tracker,
+                const std::vector<Contig> &hits,
+                const std::vector<Contig> &transcripts):
+         _sample(s),  _p_log_file(tracker)
+   {
+      init(hits, transcripts);
+   }
+
+   void init(const std::vector<Contig> &hits, const std::vector<Contig> &transcripts) {
+      assert(transcripts.size());
+      _read_len = _sample._hit_factory->_reads_table.read_len_mode();
 
       std::vector<GenomicFeature> exons; //= Contig::uniqueFeatsFromContigs(assembled_transcripts, Match_t::S_MATCH);
 
@@ -100,12 +120,14 @@ public:
       }
 
       assign_exon_bin(hits, _exon_segs);
+   }
+
+   void set_bin_weight() {
       if (long_read_sample) {
          set_bin_weight_without_frag_dist();
       } else {
          set_theory_bin_weight();
       }
-
    }
 
    decltype(auto) transcripts() const {return (_transcripts);}
@@ -170,30 +192,33 @@ public:
 
    bool estimate_abundances();
 
-   std::pair<std::set<std::pair<uint,uint>>, std::vector<double>> get_frag_info(const Contig& frag) const {
-      // return a pair of exon bin coordinates and probabilities
-      std::pair<std::set<std::pair<uint,uint>>, std::vector<double>> ret;
+   std::pair<std::set<std::pair<uint,uint>>, std::vector<int>> get_frag_class(const Contig& frag) const {
+      // return a pair of exon bin coordinates and ids of the compatible transcripts
       std::set<std::pair<uint,uint>> coords;
-      std::vector<double> info;
+      std::vector<int> iso_ids;
       for(auto iso = _transcripts.cbegin(); iso != _transcripts.cend(); ++iso) {
          if (Contig::is_compatible(frag, iso->_contig)) {
-            auto c = overlap_exons(_exon_segs, frag);
-            if (coords.empty()) coords = c;
-            else assert (coords == c);
+            if (iso_ids.empty()) coords = overlap_exons(_exon_segs, frag);
+            iso_ids.push_back(iso->id());
+         }
+      }
+      return std::make_pair(coords, iso_ids);
+   }
+
+   std::vector<double> get_frag_probs(const std::set<std::pair<uint,uint>>& coords, const std::vector<int>& iso_ids) const {
+      // bin weight under each transcript the fragment is compatible with, 0 for the others
+      std::vector<double> info;
+      for(auto iso = _transcripts.cbegin(); iso != _transcripts.cend(); ++iso) {
+         if (std::find(iso_ids.begin(), iso_ids.end(), iso->id()) != iso_ids.end()) {
             auto search = std::find(exon_bins.begin(), exon_bins.end(), ExonBin(coords));
             assert (search != exon_bins.end());
-            //std::cerr<<search->_bin_weight_map.at(iso->id())<<"\t";
             info.push_back(search->_bin_weight_map.at(iso->id()));
          }
          else {
             info.push_back(0.0);
          }
       }
-      //if (!coords.empty() && std::accumulate(info.begin(), info.end(), 0.0) == 0.0) {
-      //   std::cerr<<ExonBin(coords)<<std::endl;
-      //}
-      //std::cerr<<std::endl;
-      return std::make_pair(coords, info);
+      return info;
    }
 
 //   std::vector<std::vector<double>> calculate_bin_bias(const std::shared_ptr<FaSeqGetter> &fa_getter) const {
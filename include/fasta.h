@@ -8,7 +8,12 @@
 #define FASTA_H_
 
 #include<unordered_map>
+#include<vector>
+#include<utility>
 #include<memory>
+#include<string>
+#include<sys/types.h>
+#include<stdint.h>
 
 class FaRecord{
    /*
@@ -42,93 +47,114 @@ class FaIndex{
     * Class represents a single fasta file.
     * In some cases, it is one fasta file per chromosome, therefore multiple objects.
     * In other cases, it is one fasta file contains all chromosomes, therefore one object.
+    * The file is memory-mapped read-only once and shared by all FaSeqGetters.
+    * A bgzip-compressed fasta stays compressed in the mapping; the .fai
+    * offsets then refer to the uncompressed text and the .gzi index maps
+    * them to BGZF blocks.
     */
    std::string _fa_name; // fasta file name
    std::string _fai_name; // fasta index file name
+   std::string _gzi_name; // bgzip index file name
    bool _haveFai;
+   const char* _data = nullptr; // mapped fasta file
+   size_t _size = 0;
+   // (compressed, uncompressed) offset of every BGZF block, then of the end of the file.
+   std::vector<std::pair<uint64_t, uint64_t>> _blocks;
+   bool loadGzi();
+   void buildGzi();
+   int writeGzi();
+   int buildBgzfIndex();
 public:
    std::unordered_map<std::string, FaRecord> _records; // map seq name to record.
    using FaRecord_p = std::unordered_map<std::string, FaRecord>::const_iterator;
    FaIndex(const char* fname, const char* finame=NULL);
+   ~FaIndex();
+   FaIndex(const FaIndex &other) = delete;
+   FaIndex& operator=(const FaIndex &other) = delete;
    bool add_record(std::string seqname, const uint seqlen, const off_t fpos, const int linelen, const int lineblen);
    bool getRecord(const std::string& seqname, FaRecord &got) const;
    const std::string get_faidx_name() const;
    bool hasIndex();
    int loadIndex(); //return the number of record loaded
-   int buildIndex(); //this function has not been implemented //return the number of record
+   int buildIndex(); //scan the fasta file with num_threads threads //return the number of record
    int writeIndex(); // return number of record which is stored
    int num_records() const;
-};
-
-class SubSeq{
-public:
-   uint _subseq_start;
-   uint _subseq_len;
-   char* _sequence;
-   SubSeq():
-      _subseq_start(1),
-      _subseq_len(0),
-      _sequence(nullptr){}
-   ~SubSeq(){
-      delete []_sequence;
-      _sequence = nullptr;
-   }
-   SubSeq& operator=(const SubSeq &rhs) = delete;
-   SubSeq(const SubSeq &other) = delete;
-   SubSeq(SubSeq &&rhs):
-      _subseq_start(rhs._subseq_start),
-      _subseq_len(rhs._subseq_len),
-      _sequence(rhs._sequence)
-   {
-      rhs._sequence = nullptr;
-   }
-
-   SubSeq& operator=(SubSeq &&rhs){
-      if(this != &rhs){
-         delete []_sequence;
-         _subseq_start = rhs._subseq_start;
-         _subseq_len = rhs._subseq_len;
-         _sequence = rhs._sequence;
-         rhs._sequence = nullptr;
-      }
-      return *this;
-   }
-   void setup(uint s, uint l);
+   const char* data() const { return _data; }
+   size_t size() const { return _size; }
+   bool is_bgzf() const { return !_blocks.empty(); }
+   const std::vector<std::pair<uint64_t, uint64_t>>& blocks() const { return _blocks; }
 };
 
 class FaSeqGetter{
    /*
-    * One seq at a time in memory
+    * View of one sequence of a mapped fasta file. It owns no buffer and
+    * fetchSeq() only reads the mapping, so one getter can be shared by
+    * any number of threads.
     */
    std::string _fname;
-   FILE* _fh = nullptr;
-   SubSeq _my_subseq;
+   const char* _data = nullptr;
+   size_t _size = 0;
    FaRecord _my_record;
+   // Set when the sequence comes from a 2-bit genome (see FaInterface::write2bit).
+   const uint8_t* _packed = nullptr;
+   const uint32_t* _n_runs = nullptr; // (start, length) pairs sorted by start
+   uint32_t _num_n_runs = 0;
+   // Set when the fasta is bgzip-compressed (see FaIndex::blocks()).
+   const std::vector<std::pair<uint64_t, uint64_t>>* _gz_blocks = nullptr;
+   std::string fetchPacked(uint start, uint len) const;
+   void appendBgzf(uint64_t offset, uint len, std::string &seq) const;
+   uint64_t text_size() const;
 public:
-   const static int MAX_LEN_TO_READ = 0x20000000;
    FaSeqGetter() = default;
-   void initiate(const std::string fname, const FaRecord &rec);
+   void initiate(const std::string fname, const FaRecord &rec, const char* data, size_t size,
+                 const std::vector<std::pair<uint64_t, uint64_t>>* gz_blocks = nullptr);
+   void initiate_packed(const std::string fname, const std::string seqname, uint seq_len,
+                        const uint8_t* packed, const uint32_t* n_runs, uint32_t num_n_runs);
    std::string get_fname() const;
-   // Default parameters mean loading a whole sequence
-   // for the first time.
-   uint loadSeq(uint start = 1, uint len = 0);
-   std::string fetchSeq(uint start, uint len);
-   ~FaSeqGetter();
+   // Check that bases [start, start+len) are present in the file. len 0
+   // means to the end of the sequence. Return the number of bases.
+   uint loadSeq(uint start = 1, uint len = 0) const;
+   // start is the 1-based coordinate on the sequence.
+   std::string fetchSeq(uint start, uint len) const;
    FaSeqGetter(const FaSeqGetter &other) = delete;
    FaSeqGetter& operator=(const FaSeqGetter &other) = delete;
    FaSeqGetter(FaSeqGetter &&other) = delete;
    FaSeqGetter& operator=(FaSeqGetter &&other) = delete;
 };
 
+struct TwoBitSource;
+
 class FaInterface{
    bool _has_load = false;
+   const char* _packed_data = nullptr; // mapped 2-bit genome
+   size_t _packed_size = 0;
+   // Canonical path, size and mtime of every loaded fasta file, sorted by path.
+   std::vector<std::pair<std::string, TwoBitSource>> fastaSources() const;
 public:
    std::string _fa_path;
    std::unordered_map<std::string, std::unique_ptr<FaIndex>> _fa_indexes; //map fasta file name to faidx
    std::unordered_map<std::string, std::string> _seqname_2_fafile;   // map seq name to fasta file name.
+   std::unordered_map<std::string, std::shared_ptr<FaSeqGetter>> _getters; // map seq name to its getter.
    using ItFaidx = std::unordered_map<std::string, std::unique_ptr<FaIndex>>::iterator;
    void initiate(const char* fpath=nullptr);
    void load2FaSeqGetter(FaSeqGetter &getter, const std::string seqname);
+   // Getter of seqname, built by initiate(); safe to call from any thread.
+   std::shared_ptr<FaSeqGetter> getter(const std::string &seqname) const;
+   /*
+    * 2-bit genome: every sequence of the loaded fasta packed four bases per
+    * byte, with the runs of N (and any other non-ACGT letter) kept aside.
+    * Bases are decoded in upper case. The genome records the fasta files it
+    * was built from; matches2bit() tells whether it still agrees with the
+    * loaded fasta. write2bit() writes to path.tmp and renames it into place
+    * once complete.
+    */
+   bool matches2bit(const std::string &path) const;
+   bool write2bit(const std::string &path) const;
+   void initiate2bit(const std::string &path);
+   FaInterface() = default;
+   ~FaInterface();
+   FaInterface(const FaInterface &other) = delete;
+   FaInterface& operator=(const FaInterface &other) = delete;
    bool hasLoad() const{
       return _has_load;
    }
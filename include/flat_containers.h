@@ -0,0 +1,214 @@
+/*
+ * flat_containers.h
+ *
+ * Contiguous replacements for the node-based std::map / std::unordered_map /
+ * std::list used on the per-read paths of a HitCluster and of the splicing
+ * graph. Elements live in one array, so lookups touch a few cache lines
+ * instead of chasing one heap node per element, and clear() keeps the
+ * storage for the next cluster.
+ */
+
+#ifndef FLAT_CONTAINERS_H_
+#define FLAT_CONTAINERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+/*
+ * Ordered map kept as a vector sorted by key. Inserting is linear but
+ * finding and iterating are cheap, which suits the few hundred introns
+ * of a locus that are looked up once per spliced read.
+ */
+template<class K, class V, class Compare = std::less<K>>
+class FlatMap{
+public:
+   using value_type = std::pair<K, V>;
+   using iterator = typename std::vector<value_type>::iterator;
+   using const_iterator = typename std::vector<value_type>::const_iterator;
+private:
+   std::vector<value_type> _items;
+   static bool key_less(const value_type &item, const K &key) {
+      return Compare()(item.first, key);
+   }
+public:
+   iterator begin() { return _items.begin(); }
+   iterator end() { return _items.end(); }
+   const_iterator begin() const { return _items.begin(); }
+   const_iterator end() const { return _items.end(); }
+   const_iterator cbegin() const { return _items.cbegin(); }
+   const_iterator cend() const { return _items.cend(); }
+   size_t size() const { return _items.size(); }
+   bool empty() const { return _items.empty(); }
+   void clear() { _items.clear(); }
+
+   iterator find(const K &key) {
+      iterator it = std::lower_bound(_items.begin(), _items.end(), key, key_less);
+      return it != _items.end() && !Compare()(key, it->first) ? it : _items.end();
+   }
+   const_iterator find(const K &key) const {
+      const_iterator it = std::lower_bound(_items.begin(), _items.end(), key, key_less);
+      return it != _items.end() && !Compare()(key, it->first) ? it : _items.end();
+   }
+   std::pair<iterator, bool> emplace(const K &key, const V &value) {
+      iterator it = std::lower_bound(_items.begin(), _items.end(), key, key_less);
+      if (it != _items.end() && !Compare()(key, it->first)) return std::make_pair(it, false);
+      return std::make_pair(_items.insert(it, value_type(key, value)), true);
+   }
+   iterator erase(const_iterator it) { return _items.erase(it); }
+};
+
+/*
+ * Hash map with open addressing and linear probing over a power-of-two
+ * table. Erasing shifts the following entries back instead of leaving
+ * tombstones, so an erase invalidates iterators.
+ */
+template<class K, class V, class Hash = std::hash<K>>
+class FlatHashMap{
+public:
+   using value_type = std::pair<K, V>;
+private:
+   std::vector<value_type> _slots;
+   std::vector<uint8_t> _used;
+   size_t _size = 0;
+
+   size_t home(const K &key) const {
+      // spread std::hash, the identity for integers, over the table
+      return (uint64_t)Hash()(key) * 0x9E3779B97F4A7C15ULL >> 32 & (_slots.size() - 1);
+   }
+   size_t probe(const K &key) const {
+      size_t i = home(key);
+      while (_used[i] && !(_slots[i].first == key)) i = (i + 1) & (_slots.size() - 1);
+      return i;
+   }
+   void grow() {
+      std::vector<value_type> old_slots(std::max<size_t>(16, 2 * _slots.size()));
+      std::vector<uint8_t> old_used(old_slots.size(), 0);
+      old_slots.swap(_slots);
+      old_used.swap(_used);
+      for (size_t i = 0; i < old_slots.size(); ++i) {
+         if (!old_used[i]) continue;
+         size_t j = probe(old_slots[i].first);
+         _slots[j] = std::move(old_slots[i]);
+         _used[j] = 1;
+      }
+   }
+
+   template<class Map, class Value>
+   class Iter{
+      friend FlatHashMap;
+      Map *_map;
+      size_t _i;
+      void skip() { while (_i < _map->_slots.size() && !_map->_used[_i]) ++_i; }
+   public:
+      Iter(Map *map, size_t i): _map(map), _i(i) { skip(); }
+      Value& operator*() const { return _map->_slots[_i]; }
+      Value* operator->() const { return &_map->_slots[_i]; }
+      Iter& operator++() { ++_i; skip(); return *this; }
+      bool operator==(const Iter &rhs) const { return _i == rhs._i; }
+      bool operator!=(const Iter &rhs) const { return _i != rhs._i; }
+   };
+public:
+   using iterator = Iter<FlatHashMap, value_type>;
+   using const_iterator = Iter<const FlatHashMap, const value_type>;
+
+   iterator begin() { return iterator(this, 0); }
+   iterator end() { return iterator(this, _slots.size()); }
+   const_iterator begin() const { return const_iterator(this, 0); }
+   const_iterator end() const { return const_iterator(this, _slots.size()); }
+   size_t size() const { return _size; }
+   bool empty() const { return _size == 0; }
+
+   // Keep the table for reuse.
+   void clear() {
+      if (_size == 0) return;
+      for (size_t i = 0; i < _slots.size(); ++i) {
+         if (_used[i]) _slots[i] = value_type();
+      }
+      std::fill(_used.begin(), _used.end(), 0);
+      _size = 0;
+   }
+
+   iterator find(const K &key) {
+      if (_size == 0) return end();
+      size_t i = probe(key);
+      return _used[i] ? iterator(this, i) : end();
+   }
+   const_iterator find(const K &key) const {
+      if (_size == 0) return end();
+      size_t i = probe(key);
+      return _used[i] ? const_iterator(this, i) : end();
+   }
+   std::pair<iterator, bool> insert(value_type &&item) {
+      if (4 * (_size + 1) > 3 * _slots.size()) grow();
+      size_t i = probe(item.first);
+      if (_used[i]) return std::make_pair(iterator(this, i), false);
+      _slots[i] = std::move(item);
+      _used[i] = 1;
+      ++_size;
+      return std::make_pair(iterator(this, i), true);
+   }
+   V& operator[](const K &key) {
+      return insert(value_type(key, V())).first->second;
+   }
+   void erase(iterator it) {
+      size_t mask = _slots.size() - 1;
+      size_t hole = it._i;
+      for (size_t j = (hole + 1) & mask; _used[j]; j = (j + 1) & mask) {
+         size_t h = home(_slots[j].first);
+         // leave j alone if its home lies cyclically in (hole, j]
+         bool stays = hole <= j ? (hole < h && h <= j) : (hole < h || h <= j);
+         if (stays) continue;
+         _slots[hole] = std::move(_slots[j]);
+         hole = j;
+      }
+      _slots[hole] = value_type();
+      _used[hole] = 0;
+      --_size;
+   }
+};
+
+/*
+ * Vector holding up to N elements inline before it moves them to the
+ * heap. Erasing keeps the order of the remaining elements.
+ */
+template<class T, size_t N>
+class SmallVector{
+   T _inline[N];
+   size_t _n = 0; // elements used in _inline; unused once _heap holds them
+   std::vector<T> _heap;
+public:
+   T* begin() { return _heap.empty() ? _inline : _heap.data(); }
+   T* end() { return _heap.empty() ? _inline + _n : _heap.data() + _heap.size(); }
+   const T* begin() const { return _heap.empty() ? _inline : _heap.data(); }
+   const T* end() const { return _heap.empty() ? _inline + _n : _heap.data() + _heap.size(); }
+   size_t size() const { return _heap.empty() ? _n : _heap.size(); }
+   bool empty() const { return size() == 0; }
+
+   void push_back(const T &item) {
+      if (_heap.empty() && _n < N) {
+         _inline[_n++] = item;
+         return;
+      }
+      if (_heap.empty()) {
+         _heap.assign(_inline, _inline + _n);
+         _n = 0;
+      }
+      _heap.push_back(item);
+   }
+   void erase(T *it) {
+      assert(it >= begin() && it < end());
+      std::move(it + 1, end(), it);
+      if (_heap.empty()) {
+         _inline[--_n] = T();
+      } else {
+         _heap.pop_back();
+      }
+   }
+};
+
+#endif /* FLAT_CONTAINERS_H_ */
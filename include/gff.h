@@ -83,7 +83,7 @@ public:
 
 class GffLine{
    char* _info;
-   void extractAttr(const std::string attr, std::string &val);
+   void extractAttr(const char* attr, std::string &val);
    bool _is_gff3;
    char* _line;
 public:
@@ -113,6 +113,7 @@ public:
    std::string _transcript_id;
 
    GffLine(const char* l);
+   GffLine(const char* l, int len);
    GffLine(const GffLine &l);
    GffLine(GffLine &&l);
    GffLine& operator = (const GffLine &rhs) = delete;
@@ -243,6 +244,7 @@ using utrPtr= std::unique_ptr<GffUTR>;
 using cdsPtr = std::unique_ptr<GffCDS>;
 
 class GffLoci: public GffObj{
+   std::unordered_map<std::string, GffmRNA*> _mrna_index; // transcript id to the first such mRNA
 public:
    std::vector<GffmRNA* > _mrnas;
    std::string _gene_name;
@@ -260,10 +262,7 @@ public:
    explicit GffLoci(std::string const& name, std::string const& id): _gene_name(name), _gene_id(id) {}
    explicit GffLoci(std::string const& id): _gene_name(id), _gene_id(id) {}
 
-   void add_mRNA(GffmRNA *gffmrna)
-   {
-      _mrnas.push_back(gffmrna);
-   }
+   void add_mRNA(GffmRNA *gffmrna);
    void add_exon(exonPtr exon, GffmRNA* exon_parent);
    GffmRNA* getRNA(const std::string rna);
    int num_mRNAs() const{
@@ -305,8 +304,14 @@ using genePtr = std::unique_ptr<GffLoci>;
 
 class GffTree {
     /*
-     *
+     * Genes and transcripts of one reference sequence. The id indexes keep
+     * findGene() and findmRNA() constant time when the records of a gene or
+     * transcript are not adjacent in the annotation file.
      */
+   std::unordered_map<std::string, GffLoci*> _gene_index;
+   std::unordered_map<std::string, GffmRNA*> _forward_index;
+   std::unordered_map<std::string, GffmRNA*> _reverse_index;
+   std::unordered_map<std::string, GffmRNA*> _unstranded_index;
 public:
    std::vector<mrnaPtr> _forward_rnas;
    std::vector<mrnaPtr> _reverse_rnas; // in each GffmRNA object, exon order is from small-to-large
@@ -367,21 +372,25 @@ public:
 
    void addGene(genePtr gene)
    {
+      _gene_index.emplace(gene->_gene_id, gene.get());
       _genes.push_back(move(gene));
    }
 
    void addPlusRNA(mrnaPtr mrna)
    {
+      _forward_index.emplace(mrna->_transcript_id, mrna.get());
       _forward_rnas.push_back(move(mrna));
    }
 
    void addMinusRNA(mrnaPtr mrna)
    {
+      _reverse_index.emplace(mrna->_transcript_id, mrna.get());
       _reverse_rnas.push_back(move(mrna));
    }
 
    void addUnstrandedRNA(mrnaPtr mrna)
    {
+      _unstranded_index.emplace(mrna->_transcript_id, mrna.get());
       _unstranded_rnas.push_back(move(mrna));
    }
 
@@ -392,8 +401,29 @@ public:
 };
 
 
+/*
+ * A reference transcript reduced to what quantification needs.
+ */
+struct RefTranscript{
+   Strand_t _strand;
+   std::vector<GenomicFeature> _feats; // exons and the introns between them
+   std::string _transcript_id;
+   std::string _gene_id;
+   std::string _gene_name;
+};
+
+/*
+ * Reference transcripts of one GffTree, sorted like Contigs.
+ */
+struct AnnotatedSeq{
+   std::string _name;
+   int _gff_seq_id; // order of first appearance in the annotation file
+   std::vector<RefTranscript> _transcripts;
+};
+
 class GffReader: public SlineReader{
    std::string _fname;
+   void addGffLine(std::string &previous_chrom, GffTree* &gseq);
 public:
    std::vector<std::unique_ptr<GffTree> >  _g_seqs;
    LinePtr _gfline;
@@ -405,6 +435,7 @@ public:
       _g_seqs.push_back(move(gseq));
    }
    void sortExonOrderInMinusStrand();
+   std::vector<AnnotatedSeq> annotatedSeqs() const;
 };
 
 #endif
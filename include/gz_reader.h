@@ -0,0 +1,42 @@
+/*
+ * gz_reader.h
+ *
+ * Read-ahead decompression of gzip-compressed text files.
+ * A helper thread inflates the file into blocks that end at a line break,
+ * so the caller can parse one block while the next is being decompressed
+ * and no uncompressed copy is written to disk.
+ */
+
+#ifndef GZ_READER_H_
+#define GZ_READER_H_
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <zlib.h>
+
+class GzBlockReader{
+   gzFile _fp;
+   std::string _file_name;
+   size_t _block_size;
+   size_t _capacity = 2; // blocks inflated ahead
+   std::deque<std::string> _blocks;
+   bool _done = false;
+   bool _stop = false;
+   std::mutex _lock;
+   std::condition_variable _block_ready;
+   std::condition_variable _slot_free;
+   std::thread _thread;
+   void inflater();
+public:
+   explicit GzBlockReader(const std::string &file_name, size_t block_size = 1 << 23);
+   ~GzBlockReader();
+   GzBlockReader(const GzBlockReader&) = delete;
+   GzBlockReader& operator=(const GzBlockReader&) = delete;
+   // Next block of whole lines. Return false at the end of the file.
+   bool next(std::string &block);
+};
+
+#endif /* GZ_READER_H_ */
@@ -0,0 +1,57 @@
+/*
+ * hit_cache.h
+ *
+ * Binary cache of decoded alignments.
+ * The hits that pass the read filters of BAMHitFactory are written once in a
+ * compact fixed layout, so that re-runs with different assembly or
+ * quantification settings replay them from a memory-mapped file instead of
+ * inflating and parsing the BAM records again. Read names and sequences are
+ * not stored. The path, size and modification time of every BAM file it was
+ * built from are recorded, and a cache that does not match the BAM files of
+ * the current run is refused.
+ */
+
+#ifndef HIT_CACHE_H_
+#define HIT_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "read.hpp"
+
+class CachedHitFactory : public HitFactory
+{
+   const char* _data = NULL; // the mapped cache file
+   size_t _size = 0;
+   size_t _first_record = 0; // offset of the first hit after the header
+   size_t _offset = 0;
+   bool _eof_encountered = false;
+   std::string _cache_file_name;
+   std::vector<std::string> _bam_files;
+public:
+   /*
+    * bam_files are the alignment files of this run; inspect_header() exits
+    * if the cache was built from others. The first one names the sample.
+    */
+   CachedHitFactory(const std::string& cache_file_name,
+                    const std::vector<std::string>& bam_files,
+                    ReadTable& read_table,
+                    RefSeqTable& ref_table);
+   ~CachedHitFactory();
+   CachedHitFactory(const CachedHitFactory&) = delete;
+   CachedHitFactory& operator=(const CachedHitFactory&) = delete;
+
+   // Decode every hit of source, read from bam_files, and write them to cache_file_name.
+   static bool write(HitFactory& source, const std::vector<std::string>& bam_files,
+                     const std::string& cache_file_name);
+
+   bool recordsRemain() const;
+   void reset();
+   bool nextRecord(const char* &buf, size_t& buf_size);
+   bool getHitFromBuf(const char* bwt_buf, ReadHit& bh);
+   bool inspect_header();
+   int64_t getCurrPos();
+   void return2Pos(int64_t pos);
+};
+
+#endif /* HIT_CACHE_H_ */
@@ -40,6 +40,7 @@ class FaSeqGetter;
 class Isoform{
 
    int _isoform_id;
+   friend struct SpillCodec<Isoform>;
 public:
    int _length;
    Contig _contig;
@@ -10,10 +10,12 @@
 #include<memory>
 #include<string>
 #include<unordered_map>
+#include<queue>
 #include<cassert>
 #include <iostream>
 #include "common.h"
 #include "sam/sam.h"
+#include "bgzf_reader.h"
 //#include "kmer.h"
 
 //using namespace std;
@@ -83,8 +85,9 @@ private:
    int _trans_left=0; // position relate to transcriptom
    uint32_t _sam_flag = 0; //bitwise FLAG
    double _read_mass = 0.0;
+   std::vector<uint8_t> _packed_seq; // 4-bit BAM encoding, two bases per byte
+   uint _seq_len = 0;
 public:
-   std::string _seq;
    ReadHit() = default;
    ReadHit( ReadID readID,
             std::string read_name,
@@ -96,7 +99,8 @@ public:
          int numHit,
          uint32_t samFlag,
          double mass,
-         char* seq
+         const uint8_t* packed_seq,
+         uint seq_len
          );
 //   ~ReadHit(){
 //      if(_seq != NULL){
@@ -116,6 +120,7 @@ public:
    RefID ref_id() const; // chromosome id or scaffold id containing the read
    int num_mismatch() const;
    int numHits() const;
+   uint32_t sam_flag() const;
    bool is_singleton() const;
    std::string read_name() const {
       return _read_name;
@@ -133,7 +138,7 @@ public:
    bool operator==(const ReadHit& rhs) const; // not considering read orientation
    bool operator!=(const ReadHit& rhs) const;
    bool operator<(const ReadHit& rhs) const;
-   //char* read_seq() const;
+   std::string seq() const; // decoded on demand
    //std::vector<CigarOp> cigars() const;
 };
 
@@ -225,6 +230,7 @@ protected:
    int _num_seq_header_recs = 0;
    std::string _hit_file_name;
    AssayProperties _assay_props;
+   std::vector<ReadHit> _lookahead; // decoded hits handed back by unget_hit()
 public:
    ReadTable& _reads_table;
    RefSeqTable& _ref_table;
@@ -241,10 +247,22 @@ public:
    virtual bool getHitFromBuf(const char* bwt_buf, ReadHit& bh)=0;
    virtual RefSeqTable& ref_table() { return _ref_table; }
    virtual ReadTable& reads_table(){return _reads_table;}
-   virtual void undo_hit() = 0;
+   // Hand back a hit that has been read but not used. It is returned by
+   // next_ungot_hit() before any further record is read from the file.
+   void unget_hit(ReadHit &&hit) {
+      _lookahead.push_back(std::move(hit));
+   }
+   bool next_ungot_hit(ReadHit &hit) {
+      if (_lookahead.empty()) return false;
+      hit = std::move(_lookahead.back());
+      _lookahead.pop_back();
+      return true;
+   }
    virtual bool parse_header_line(const std::string& hline);
    virtual bool inspect_header() = 0;
    virtual void reset() = 0;
+   // false when reading from a stream; reset() and return2Pos() need to seek
+   virtual bool seekable() const { return true; }
    virtual std::string sample_path() const {
       return _hit_file_name;
    }
@@ -257,21 +275,48 @@ class BAMHitFactory : public HitFactory
 private:
 
    samfile_t* _hit_file;
-   int64_t _curr_pos;
    int64_t _beginning;
 
    bam1_t _next_hit;
    bool _eof_encountered;
+   std::unique_ptr<BGZFReader> _reader; // parallel decompression with -p
+
+   // region mode: records of one reference sequence fetched through the .bai
+   bam_index_t* _index = NULL; // owned unless _tid >= 0
+   bam_iter_t _iter = NULL;
+   int _tid = -1;
+   int _beg = 0;
+   int _end = 1<<29;
+
+   std::vector<RefID> _tid2ref; // BAM tid -> RefID, filled by inspect_header()
+   RefID tid2ref(int tid) const {
+      return tid < 0 ? -1 : _tid2ref[tid];
+   }
 
 public:
    BAMHitFactory(const std::string& bam_file_name,
                  ReadTable& read_table,
                  RefSeqTable &ref_table);
+   BAMHitFactory(const BAMHitFactory& whole_file,
+                 ReadTable& read_table,
+                 int tid);
    ~BAMHitFactory();
+   bool load_index();
+   int num_targets() const {
+      return _hit_file->header->n_targets;
+   }
+   uint32_t target_len(int tid) const {
+      return _hit_file->header->target_len[tid];
+   }
+   void set_region(int tid, int beg, int end);
+   RefID target_ref_id(int tid) const {
+      return tid2ref(tid);
+   }
    bool recordsRemain() const;
-   void markCurrPos();
+   bool seekable() const {
+      return _hit_file_name != "-";
+   }
    void reset();
-   void undo_hit();
    bool nextRecord(const char* &buf, size_t& buf_size);
    bool getHitFromBuf(const char* bwt_buf, ReadHit& bh);
    bool inspect_header();
@@ -279,11 +324,75 @@ public:
    void return2Pos(int64_t pos);
 };
 
-typedef std::shared_ptr<ReadHit> ReadHitPtr;
+class MergedHitFactory : public HitFactory
+{
+   /*
+    * Reads several coordinate sorted BAM files of one sample as if they were
+    * merged. Each input keeps its next record and the inputs are ordered by a
+    * heap on (RefID, pos), ties going to the earlier input. The inputs share
+    * the reference table, so their headers have to list the reference
+    * sequences in the same order. With -p every input decompresses on its own
+    * helper threads.
+    */
+   typedef std::pair<uint64_t, size_t> HeapEntry; // (RefID, pos) key, input index
+   std::vector<std::unique_ptr<BAMHitFactory>> _inputs;
+   std::vector<const char*> _bufs;
+   std::vector<size_t> _buf_sizes;
+   std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> _heap;
+   int _last = -1; // input of the record returned last; advanced on the next call
+   bool _started = false;
+   bool _eof_encountered = false;
+
+   void advance(size_t i);
+public:
+   MergedHitFactory(const std::vector<std::string>& bam_file_names,
+                    ReadTable& read_table,
+                    RefSeqTable &ref_table);
+   bool recordsRemain() const;
+   bool seekable() const;
+   void reset();
+   bool nextRecord(const char* &buf, size_t& buf_size);
+   bool getHitFromBuf(const char* bwt_buf, ReadHit& bh);
+   bool inspect_header();
+   int64_t getCurrPos();
+   void return2Pos(int64_t pos);
+};
+
+class ReadHitArena{
+   /*
+    * Owns the ReadHits of a HitCluster. Hits are moved into fixed-size blocks
+    * and keep their address until the arena is destroyed, so PairedHit
+    * refers to them by plain pointers.
+    */
+   static const size_t kBlockSize = 512;
+   static const size_t kHeapBytesPerHit = 128; // name, CIGAR and packed sequence of a short read
+   std::vector<std::unique_ptr<ReadHit[]>> _blocks;
+   size_t _used = kBlockSize;
+public:
+   ReadHit* keep(ReadHit &&hit){
+      if(_used == kBlockSize){
+         _blocks.emplace_back(new ReadHit[kBlockSize]);
+         _used = 0;
+      }
+      ReadHit* slot = &_blocks.back()[_used++];
+      *slot = std::move(hit);
+      return slot;
+   }
+   // Free what a hit holds on the heap once nothing refers to it; the slot stays.
+   static void release(ReadHit* hit){
+      *hit = ReadHit();
+   }
+   size_t mem_size() const {
+      return _blocks.size() * kBlockSize * (sizeof(ReadHit) + kHeapBytesPerHit);
+   }
+};
+
+typedef ReadHit* ReadHitPtr; // owned by a ReadHitArena
 
 
 class PairedHit{
    double _collapse_mass = 0.0;
+   int _collapse_count = 0; // number of identical fragments folded into this one
    double _mass = 0.0;
 public:
    ReadHitPtr _right_read ;
@@ -297,6 +406,7 @@ public:
       _left_read = rhs._left_read;
       _right_read = rhs._right_read;
       _collapse_mass = rhs._collapse_mass;
+      _collapse_count = rhs._collapse_count;
       return *this;
    }
    const ReadHit& left_read_obj() const;
@@ -320,11 +430,21 @@ public:
    bool paried_hit_lt(const PairedHit &rhs) const;
    void add_2_collapse_mass(double add);
    double collapse_mass() const;
+   void add_2_collapse_count(int add);
+   int collapse_count() const;
    void init_raw_mass();
    void weighted_mass(double m);
    double weighted_mass() const;
    //void set_kmers(int num_kmers);
 };
 
+// Consistent with PairedHit::operator==: the mates present, their left ends and cigars.
+struct PairedHitHash{
+   size_t operator()(const PairedHit &hit) const;
+};
+
+// Same order as stable_sort() with PairedHit::operator<, without its pointer chasing.
+void sort_paired_hits(std::vector<PairedHit> &hits);
+
 void mean_and_sd_insert_size(const std::vector<int> & vec, double & mean, double &sd);
 #endif /* READ_HPP */
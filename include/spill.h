@@ -0,0 +1,155 @@
+/*
+ * spill.h
+ *
+ * The --max-memory budget. Clusters handed to worker threads and the
+ * transcripts and isoforms collected from them are charged against it.
+ * A worker only starts on a cluster that fits in what is left, and
+ * collected results are moved to an unnamed temporary file once they
+ * take more than their share. They are read back in the order they were
+ * added.
+ */
+
+#ifndef SPILL_H_
+#define SPILL_H_
+
+#include <stdio.h>
+#include <atomic>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include "contig.h"
+#include "isoform.h"
+
+class MemoryBudget
+{
+   static std::atomic<size_t> _in_use;
+public:
+   static bool enabled() { return kMaxMemory > 0; }
+   static void charge(size_t bytes) { _in_use += bytes; }
+   static void release(size_t bytes) { _in_use -= bytes; }
+   static bool fits(size_t bytes) { return _in_use + bytes <= kMaxMemory; }
+   // Results kept in memory by one SpillVector before it spills.
+   static size_t result_share() { return kMaxMemory / 8; }
+};
+
+/*
+ * write(), read() and mem_size() of the items a SpillVector holds.
+ * read() exits if the file ends early.
+ */
+template<> struct SpillCodec<Contig>
+{
+   static void write(FILE *out, const Contig &contig);
+   static Contig read(FILE *in);
+   static size_t mem_size(const Contig &contig);
+};
+
+template<> struct SpillCodec<Isoform>
+{
+   static void write(FILE *out, const Isoform &iso);
+   static Isoform read(FILE *in);
+   static size_t mem_size(const Isoform &iso);
+};
+
+// An unnamed file under $TMPDIR (or /tmp), removed when closed.
+FILE* open_spill_file();
+
+/*
+ * Append-only sequence whose older items may live in a spill file.
+ * Not thread safe; callers hold the lock that guarded the vector it
+ * replaces.
+ */
+template<class T>
+class SpillVector
+{
+   std::vector<T> _items; // added after the spilled ones
+   size_t _bytes = 0; // charged for _items
+   FILE* _file = NULL;
+   size_t _num_spilled = 0;
+
+   void spill() {
+      if (_file == NULL) _file = open_spill_file();
+      fseek(_file, 0, SEEK_END);
+      for (const T &item: _items) SpillCodec<T>::write(_file, item);
+      _num_spilled += _items.size();
+      std::vector<T>().swap(_items);
+      MemoryBudget::release(_bytes);
+      _bytes = 0;
+   }
+   void charge(const T &item) {
+      if (!MemoryBudget::enabled()) return;
+      size_t bytes = SpillCodec<T>::mem_size(item);
+      MemoryBudget::charge(bytes);
+      _bytes += bytes;
+   }
+   void check_budget() {
+      if (MemoryBudget::enabled() && !_items.empty() &&
+          (_bytes > MemoryBudget::result_share() || !MemoryBudget::fits(0))) {
+         spill();
+      }
+   }
+public:
+   SpillVector() = default;
+   SpillVector(const SpillVector&) = delete;
+   SpillVector& operator=(const SpillVector&) = delete;
+   SpillVector(SpillVector &&rhs) { *this = std::move(rhs); }
+   SpillVector& operator=(SpillVector &&rhs) {
+      if (this == &rhs) return *this;
+      clear();
+      _items = std::move(rhs._items);
+      std::swap(_bytes, rhs._bytes);
+      std::swap(_file, rhs._file);
+      std::swap(_num_spilled, rhs._num_spilled);
+      rhs._items.clear();
+      return *this;
+   }
+   ~SpillVector() { clear(); }
+
+   size_t size() const { return _num_spilled + _items.size(); }
+   bool empty() const { return size() == 0; }
+
+   void push_back(T &&item) {
+      charge(item);
+      _items.push_back(std::move(item));
+      check_budget();
+   }
+   void append(std::vector<T> &&items) {
+      for (const T &item: items) charge(item);
+      std::move(items.begin(), items.end(), std::back_inserter(_items));
+      items.clear();
+      check_budget();
+   }
+
+   // Call f on every item in the order they were added.
+   template<class F>
+   void for_each(F f) {
+      if (_file != NULL) {
+         fflush(_file);
+         rewind(_file);
+         for (size_t i = 0; i < _num_spilled; ++i) {
+            T item = SpillCodec<T>::read(_file);
+            f(item);
+         }
+      }
+      for (T &item: _items) f(item);
+   }
+
+   // Move every item back into memory and leave this empty.
+   std::vector<T> release() {
+      std::vector<T> result;
+      result.reserve(size());
+      for_each([&result](T &item) { result.push_back(std::move(item)); });
+      clear();
+      return result;
+   }
+
+   void clear() {
+      std::vector<T>().swap(_items);
+      MemoryBudget::release(_bytes);
+      _bytes = 0;
+      if (_file != NULL) fclose(_file);
+      _file = NULL;
+      _num_spilled = 0;
+   }
+};
+
+#endif /* SPILL_H_ */
@@ -4,10 +4,13 @@
 #include <chrono>
 #include <fstream>
 #include <libgen.h>
+#include <unistd.h>
 
 #include "fasta.h"
 #include "gff.h"
 #include "alignments.h"
+#include "hit_cache.h"
+#include "annotation_cache.h"
 #include "StrawberryConfig.hpp"
 #include "interval.hpp"
 #include "isoform.h"
@@ -25,6 +28,13 @@
 #define OPT_NO_QUANT 265
 #define OPT_FR_STRAND 266
 #define OPT_RF_STRAND 267
+#define OPT_SINGLE_PASS 268
+#define OPT_SHARD_BY_CHROM 269
+#define OPT_HIT_CACHE 270
+#define OPT_GENOME_2BIT 271
+#define OPT_GTF_CACHE 272
+#define OPT_MAX_LOCUS_FRAGS 273
+#define OPT_MAX_MEMORY 274
 //#define OPT_NO_ASSEMBLY 260
 using namespace std;
 
@@ -43,11 +53,15 @@ static struct option long_options[] = {
       {"rf",                               no_argument,            0,       OPT_RF_STRAND},
 #if ENABLE_THREADS
       {"num-threads",                      required_argument,      0,       'p'},
+      {"shard-by-chrom",                   no_argument,            0,       OPT_SHARD_BY_CHROM},
 #endif
 //assembly
       {"GTF",                             required_argument,      0,       'g'},
       {"no-assembly",                     no_argument,            0,       'r'},
+      {"gtf-cache",                       required_argument,      0,       OPT_GTF_CACHE},
       {"no-quant",                        no_argument,            0,       OPT_NO_QUANT},
+      {"single-pass",                     no_argument,            0,       OPT_SINGLE_PASS},
+      {"hit-cache",                       required_argument,      0,       OPT_HIT_CACHE},
       {"min-transcript-size",             required_argument,      0,       't'},
       {"max-overlap-distance",            required_argument,      0,       'd'},
       {"small-anchor-size",               required_argument,      0,       's'},
@@ -59,10 +73,13 @@ static struct option long_options[] = {
 //quantification
       {"insert-size-mean-and-sd",         required_argument,      0,       'i'},
       {"bias-correction",                 required_argument,      0,       'b'},
+      {"genome-2bit",                     required_argument,      0,       OPT_GENOME_2BIT},
       {"min-isoform-frac",                required_argument,      0,       'm'},
       {"fragment-context",                required_argument,      0,       'f'},
       {"filter-low-expression",           required_argument,      0,       'e'},
       {"min-exon-cov",                    required_argument,      0,       OPT_MIN_EXON_COV},
+      {"max-locus-frags",                 required_argument,      0,       OPT_MAX_LOCUS_FRAGS},
+      {"max-memory",                      required_argument,      0,       OPT_MAX_MEMORY},
       {0, 0, 0, 0} // terminator
 };
 
@@ -72,14 +89,20 @@ void print_help()
 {
    fprintf(stderr, "\nstrawberry v%s\n", strawberry::version);
    fprintf(stderr, "--------------------------------------\n");
-   fprintf(stderr, "Usage: strawberry [options] <input.bam> \n");
+   fprintf(stderr, "Usage: strawberry [options] <input.bam> [<input2.bam> ...]\n");
+   fprintf(stderr, "       Several sorted BAM files of one sample are merged on the fly.\n");
+   fprintf(stderr, "       Use - as <input.bam> to read a coordinate sorted BAM stream from stdin.\n");
    fprintf(stderr, "General Options:\n");
    fprintf(stderr, "   -o/--output-gtf                       Output gtf file.                                                                                     [default:     ./strawberry_assembled.gtf ]\n");
    fprintf(stderr, "   -T/--logfile                          Log file.                                                                                            [default:     /tmp/strawberry.log ]\n");
-   fprintf(stderr, "   -g/--GTF                              Reference transcripts annotation file. Current support gff3 and gtf format.                          [default:     NULL]\n");
+   fprintf(stderr, "   -g/--GTF                              Reference transcripts annotation file. Current support gff3 and gtf format, optionally gzipped.      [default:     NULL]\n");
    fprintf(stderr, "   -r/--no-assembly                      Skip assembly and use reference annotation to quantify transcript abundance (only use with -g)       [default:     false]\n");
+   fprintf(stderr, "   --gtf-cache                           Read the -g annotation from this binary cache; build it from the annotation file if it does not exist. [default:     NULL]\n");
    fprintf(stderr, "   --no-quant                            Skip quantification                                                                                  [default:     false]\n");
+   fprintf(stderr, "   --single-pass                         Assemble and quantify in one pass over the BAM file.                                                 [default:     false]\n");
+   fprintf(stderr, "   --hit-cache                           Read alignments from this binary cache; build it from the BAM file(s) if it does not exist.          [default:     NULL]\n");
    fprintf(stderr, "   -p/--num-threads                      number of threads used for Strawberry                                                                [default:     1]\n");
+   fprintf(stderr, "   --shard-by-chrom                      Process chromosomes concurrently. Requires a BAM index (.bai).                                       [default:     false]\n");
    fprintf(stderr, "   -v/--verbose                          Strawberry starts to gives more information.                                                         [default:     false]\n");
    fprintf(stderr, "   -q/--min-mapping-qual                 Minimum mapping quality to be included in the analyses.                                              [default:     0]\n");
    fprintf(stderr, "   --fr                                  assume stranded library fr-secondstrand.                                                             [default:     false]\n");
@@ -89,6 +112,9 @@ void print_help()
    fprintf(stderr, "   -m/--min-isoform-frac                 Minimum isoform fraction.                                                                            [default:     0.01]\n");
    //fprintf(stderr, "   -n/--num-read-4-prerun                Use this number of reads to calculate empirical insert size distribution.                            [default:     500000]\n");
    fprintf(stderr, "   --allow-multimapped-hits              By default, Strawberry only use reads which map to unique position in the genome.                    [default:     false]\n");
+   fprintf(stderr, "   --max-locus-frags                     Merge near-identical fragments of a locus with more distinct fragments than this; 0 disables.        [default:     0]\n");
+   fprintf(stderr, "   --max-memory                          Memory budget in MB for worker clusters and printed results, spilled to $TMPDIR. 0 disables.         [default:     0]\n");
+   fprintf(stderr, "                                         Reference and assembled transcripts held for quantification are not counted. Ignored with --single-pass.\n");
    fprintf(stderr, "\n Assembly Options:\n");
    fprintf(stderr, "   -t/--min-transcript-size              Minimun transcript size to be assembled.                                                             [default:     200]\n");
    fprintf(stderr, "   -d/--max-overlap-distance             Maximum distance between read clusters to be merged.                                                 [default:     30]\n");
@@ -104,7 +130,8 @@ void print_help()
    fprintf(stderr, "   -f/--fragment-context                 Print fragment context for differential expression to this file.                                     [default:     Disabled]\n");
    fprintf(stderr, "   -i/--insert-size-mean-and-sd          User specified insert size mean and standard deviation, format: mean/sd, e.g., 300/25.               [default:     Disabled]\n");
    fprintf(stderr, "                                         This will disable empirical insert distribution learning.                                            [default:     NULL]\n");
-   fprintf(stderr, "   -b/--bias-correction                  Specify reference genome for bias correction.                                                        [default:     NULL]\n");
+   fprintf(stderr, "   -b/--bias-correction                  Specify reference genome for bias correction (fasta, bgzip compressed fasta or a directory).         [default:     NULL]\n");
+   fprintf(stderr, "   --genome-2bit                         Read the -b genome from this 2-bit packed file; build it when missing or out of date with the fasta. [default:     NULL]\n");
    //fprintf(stderr, "  --infer-missing-end                Disable infering the missing end for a pair of reads.                                                [default:     true]\n" );
    fprintf(stderr, "   -e/--filter-low-expression            Skip isoforms whose relative expression (within locus) are less than this number.                    [default:     0.]\n" );
 }
@@ -172,6 +199,21 @@ int parse_options(int argc, char** argv)
                case OPT_NO_QUANT:
                         no_quant = true;
                         break;
+               case OPT_SINGLE_PASS:
+                        single_pass = true;
+                        break;
+               case OPT_SHARD_BY_CHROM:
+                        shard_by_chrom = true;
+                        break;
+               case OPT_HIT_CACHE:
+                        hit_cache_file = optarg;
+                        break;
+               case OPT_GENOME_2BIT:
+                        genome_2bit_file = optarg;
+                        break;
+               case OPT_GTF_CACHE:
+                        gtf_cache_file = optarg;
+                        break;
                case 'e':
                         kMinIsoformFrac = parseFloat(optarg, 0, 1.0, "-e/--filter-low-expression must be between 0-1.0", print_help);
                         //filter_by_expression = true;
@@ -191,6 +233,12 @@ int parse_options(int argc, char** argv)
                case OPT_MIN_SUPPORT_4_INTRON:
                         kMinJuncSupport = parseInt(optarg, 1, "--min-support-4-intron must be at least 1", print_help);
                         break;
+               case OPT_MAX_LOCUS_FRAGS:
+                        kMaxFragsPerLocus = parseInt(optarg, 0, "--max-locus-frags must be at least 0", print_help);
+                        break;
+               case OPT_MAX_MEMORY:
+                        kMaxMemory = (size_t)parseInt(optarg, 0, "--max-memory must be at least 0", print_help) << 20;
+                        break;
                case OPT_MIN_EXON_COV:
                         kMinExonDoc= parseFloat(optarg, 0, 999999.0, "--min-exon-cov must be at least 0", print_help);
                         break;
@@ -234,24 +282,55 @@ int parse_options(int argc, char** argv)
 
 
 
-int driver(const char* const bam_file, FILE* pFile, FILE* plogfile, FILE* pfragfile){
+int driver(const vector<string>& bam_files, FILE* pFile, FILE* plogfile, FILE* pfragfile){
    auto start = chrono::steady_clock::now();
    ReadTable read_table;
    RefSeqTable ref_seq_table(true);
-   shared_ptr<HitFactory> hf(new BAMHitFactory(bam_file, read_table, ref_seq_table));
-   hf->inspect_header();
+   shared_ptr<HitFactory> hf;
+   if (hit_cache_file != "" && fileExists(hit_cache_file.c_str()) &&
+       find(bam_files.begin(), bam_files.end(), "-") != bam_files.end()) {
+      cerr << "Hit cache " << hit_cache_file << " cannot be checked against alignments from stdin."
+           << " Remove it to rebuild." << endl;
+      exit(1);
+   }
+   if (hit_cache_file == "" || !fileExists(hit_cache_file.c_str())) {
+      if (bam_files.size() == 1) {
+         hf = shared_ptr<HitFactory>(new BAMHitFactory(bam_files[0], read_table, ref_seq_table));
+      } else {
+         hf = shared_ptr<HitFactory>(new MergedHitFactory(bam_files, read_table, ref_seq_table));
+      }
+      hf->inspect_header();
+   }
+   if (hit_cache_file != "") {
+      if (hf) {
+         cerr << "Writing hit cache " << hit_cache_file << endl;
+         if (!CachedHitFactory::write(*hf, bam_files, hit_cache_file)) {
+            unlink(hit_cache_file.c_str());
+            exit(1);
+         }
+      }
+      hf = shared_ptr<HitFactory>(new CachedHitFactory(hit_cache_file, bam_files, read_table, ref_seq_table));
+      hf->inspect_header();
+   }
    Sample read_sample(move(hf));
 
    GffReader* greader= NULL;
-   if(ref_gtf_filename != ""){
+   if(ref_gtf_filename != "" && gtf_cache_file != "" && fileExists(gtf_cache_file.c_str())){
+      vector<AnnotatedSeq> gseqs = AnnotationCache::read(ref_gtf_filename, gtf_cache_file);
+      read_sample.loadRefmRNAs(gseqs, ref_seq_table);
+      cerr<<"Has loaded transcripts from "<<gseqs.size()<<" Chromosomes/Scaffolds"<<endl;
+   }
+   else if(ref_gtf_filename != ""){
       FILE* gff = fopen(ref_gtf_filename.c_str(), "r");
       if(gff == NULL){
          fprintf(stderr, "Error: cannot open refernce gtf file %s for reading\n", ref_gtf_filename.c_str());
          exit(1);
       }
-      string fext = ref_gtf_filename.substr(ref_gtf_filename.find_last_of(".") + 1);
+      string gtf_name = ref_gtf_filename;
+      if (endsWith(gtf_name, ".gz")) gtf_name.resize(gtf_name.size() - 3);
+      string fext = gtf_name.substr(gtf_name.find_last_of(".") + 1);
       if (fext != "gtf" && fext != "gff3") {
-         fprintf(stderr, "Error: reference annotation file must be .gtf or .gff3. Please make sure you unzip.\n");
+         fprintf(stderr, "Error: reference annotation file must be .gtf or .gff3, optionally gzip compressed (.gtf.gz or .gff3.gz).\n");
          exit(1);
       }
       greader = new GffReader(ref_gtf_filename.c_str(), gff);
@@ -269,10 +348,17 @@ int driver(const char* const bam_file, FILE* pFile, FILE* plogfile, FILE* pfragf
 //      std::cerr<<"number of two-isoform genes: "<<num_iso2gene<<std::endl;
 //      exit(0);
       greader->sortExonOrderInMinusStrand();
-      read_sample.loadRefmRNAs(greader->_g_seqs, ref_seq_table);
-      cerr<<"Has loaded transcripts from "<<greader->_g_seqs.size()<<" Chromosomes/Scaffolds"<<endl;
+      vector<AnnotatedSeq> gseqs = greader->annotatedSeqs();
       delete greader;
       greader = NULL;
+      if (gtf_cache_file != "") {
+         cerr << "Writing annotation cache " << gtf_cache_file << endl;
+         if (!AnnotationCache::write(gseqs, ref_gtf_filename, gtf_cache_file)) {
+            exit(1);
+         }
+      }
+      read_sample.loadRefmRNAs(gseqs, ref_seq_table);
+      cerr<<"Has loaded transcripts from "<<gseqs.size()<<" Chromosomes/Scaffolds"<<endl;
    }
 
 
@@ -282,14 +368,25 @@ int driver(const char* const bam_file, FILE* pFile, FILE* plogfile, FILE* pfragf
       //}
       //else{
          shared_ptr<FaInterface> fa_api(new FaInterface());
+         // Indexing the fasta only maps it, so do it even with a 2-bit genome to check that genome against it.
          fa_api->initiate(ref_fasta_file.c_str());
-         shared_ptr<FaSeqGetter> fsg(new FaSeqGetter());
+         if (genome_2bit_file != "") {
+            if (!fa_api->matches2bit(genome_2bit_file)) {
+               cerr << "Writing 2-bit genome " << genome_2bit_file << endl;
+               if (!fa_api->write2bit(genome_2bit_file)) {
+                  exit(1);
+               }
+            }
+            fa_api.reset(new FaInterface());
+            fa_api->initiate2bit(genome_2bit_file);
+         }
          read_sample._fasta_interface = move(fa_api);
-         read_sample._fasta_getter = move(fsg);
       //}
    }
 
-   read_sample.inspect_read_len();
+   if (!read_sample.inspectByIndex()) {
+      read_sample.inspect_read_len();
+   }
    const auto read_len_dist = read_sample._hit_factory->_reads_table._read_len_abs;
    int count = 0;
    for (auto it = read_len_dist.cbegin(); it != read_len_dist.cend(); ++it) {
@@ -309,16 +406,47 @@ int driver(const char* const bam_file, FILE* pFile, FILE* plogfile, FILE* pfragf
 //      }
       cerr << "read len mode: " <<read_sample._hit_factory->_reads_table.read_len_mode() << endl;
    }
-   if (no_assembly) read_sample.preProcess(plogfile);
+   if (no_quant) single_pass = false;
+   if (!read_sample._hit_factory->seekable()) {
+      // quantification after a separate assembly pass would need to read the input twice
+      if (!no_quant && !single_pass) {
+         cerr << "Reading alignments from stdin. Switch to --single-pass." << endl;
+         single_pass = true;
+      }
+      if (shard_by_chrom) {
+         cerr << "--shard-by-chrom needs an indexed BAM file. Ignore --shard-by-chrom." << endl;
+         shard_by_chrom = false;
+      }
+   }
+   if (single_pass && MemoryBudget::enabled()) {
+      // the loci waiting for normalization are not charged and cannot be spilled
+      cerr << "--max-memory is not supported with --single-pass. Ignore --max-memory." << endl;
+      kMaxMemory = 0;
+   }
+   if (shard_by_chrom && single_pass) {
+      cerr << "--shard-by-chrom is not supported with --single-pass. Ignore --shard-by-chrom." << endl;
+      shard_by_chrom = false;
+   }
+   if (shard_by_chrom && (bam_files.size() > 1 || hit_cache_file != "")) {
+      cerr << "--shard-by-chrom is not supported with several BAM files or --hit-cache. Ignore --shard-by-chrom." << endl;
+      shard_by_chrom = false;
+   }
+   if (shard_by_chrom && !read_sample.loadBamIndex()) {
+      cerr << "Cannot load the BAM index. Ignore --shard-by-chrom." << endl;
+      shard_by_chrom = false;
+   }
+   if (shard_by_chrom) read_sample.assembleShards(plogfile);
+   else if (single_pass) read_sample.streamSample(plogfile, pfragfile != NULL);
+   else if (no_assembly) read_sample.preProcess(plogfile);
    else read_sample.assembleSample(plogfile);
 
 
 
    if (no_quant) {
-      for (const auto &iso: read_sample._assembly) {
+      read_sample._assembly.for_each([&](const Contig &iso) {
          iso.print2gtf(pFile, read_sample._hit_factory->_ref_table, "",
                                "", "", iso.parent_id(), iso.annotated_trans_id(), iso.ref_gene_id(), iso.ref_gene_name());
-      }
+      });
       return 0;
    }
    if(verbose){
@@ -356,7 +484,9 @@ int driver(const char* const bam_file, FILE* pFile, FILE* plogfile, FILE* pfragf
    }
 
 
-   read_sample.procSample(pFile, plogfile, pfragfile);
+   if (shard_by_chrom) read_sample.procShards(pFile, plogfile, pfragfile);
+   else if (single_pass) read_sample.procPendingLoci(pFile, plogfile, pfragfile);
+   else read_sample.procSample(pFile, plogfile, pfragfile);
 
    fclose(pFile);
    fclose(plogfile);
@@ -432,8 +562,8 @@ int main(int argc, char** argv){
    FILE* pfragfile = NULL;
    if (print_frag_context) pfragfile = fopen(frag_context_out.c_str(), "w");
 
-   char* bam_file = argv[optind++];
-   driver(bam_file, pFile, plogfile, pfragfile);
+   vector<string> bam_files(argv + optind, argv + argc);
+   driver(bam_files, pFile, plogfile, pfragfile);
    fprintf(stdout, "Program finished\n");
    return 0;
 }
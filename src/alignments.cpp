@@ -7,6 +7,7 @@
 #include <atomic>
 #include <chrono>
 #include <complex>
+#include <functional>
 #include "alignments.h"
 #include "fasta.h"
 #include "assembly.h"
@@ -25,6 +26,23 @@ void decr_pool_count()
 {
    --curr_thread_num;
 }
+
+static size_t wait_for_worker(const HitCluster &cluster)
+/*
+ * Wait for a free worker slot. With --max-memory, also wait until the
+ * clusters held by running workers leave room for this one; a cluster
+ * larger than the whole budget runs once every other worker is done.
+ * Returns the bytes charged, which the worker releases when it finishes.
+ */
+{
+   size_t bytes = MemoryBudget::enabled() ? cluster.mem_size() : 0;
+   while (curr_thread_num >= num_threads || (curr_thread_num > 0 && !MemoryBudget::fits(bytes))) {
+      this_thread::sleep_for(chrono::milliseconds(3));
+   }
+   ++curr_thread_num;
+   MemoryBudget::charge(bytes);
+   return bytes;
+}
 #endif
 /*
  * Global utility function begin:
@@ -117,7 +135,7 @@ vector<Contig> Sample::assembleContig(const uint l, const uint r, const Strand_t
 }
 
 vector<Contig> Sample::runFlowAlgorithm(const Strand_t& strand, const vector<Contig>& hits,
-                                      const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+                                      const IntronMap &intron_counter,
                                       const std::vector<GenomicFeature> &exons) {
    FlowNetwork flow_network;
    Graph::NodeMap<const GenomicFeature *> node_map(flow_network._g);
@@ -154,7 +172,8 @@ HitCluster::HitCluster():
    //_first_encounter_strand(Strand_t::StrandUnknown),
    _ref_id(-1),
    _final(false),
-   _raw_mass(0.0)
+   _raw_mass(0.0),
+   _arenas(1, make_shared<ReadHitArena>())
 {}
 
 void HitCluster::refine_cluster(){
@@ -373,22 +392,18 @@ Strand_t HitCluster::ref_strand() const{
 Strand_t HitCluster::guessStrand() const{
    int max_count = INT_MIN;
    Strand_t best_strand = Strand_t::StrandUnknown;
-   if (_strand_intron.find(Strand_t::StrandPlus) != _strand_intron.end()) {
-      for (auto const& i : _strand_intron.at(Strand_t::StrandPlus)) {
-         //std::cerr<<"+, "<<i.first<<":"<<i.second<<std::endl;
-         if (i.second > max_count) {
-            max_count = i.second;
-            best_strand = Strand_t::StrandPlus;
-         }
+   for (auto const& i : _strand_intron[(int)Strand_t::StrandPlus]) {
+      //std::cerr<<"+, "<<i.first<<":"<<i.second<<std::endl;
+      if (i.second > max_count) {
+         max_count = i.second;
+         best_strand = Strand_t::StrandPlus;
       }
    }
-   if (_strand_intron.find(Strand_t::StrandMinus) != _strand_intron.end()) {
-      for (auto const& i : _strand_intron.at(Strand_t::StrandMinus)) {
-         //std::cerr<<"-, "<<i.first<<":"<<i.second<<std::endl;
-         if (i.second > max_count) {
-            max_count = i.second;
-            best_strand = Strand_t::StrandMinus;
-         }
+   for (auto const& i : _strand_intron[(int)Strand_t::StrandMinus]) {
+      //std::cerr<<"-, "<<i.first<<":"<<i.second<<std::endl;
+      if (i.second > max_count) {
+         max_count = i.second;
+         best_strand = Strand_t::StrandMinus;
       }
    }
    return best_strand;
@@ -420,18 +435,26 @@ void HitCluster::reset(uint old_left,
 }
 
 
+static inline uint64_t intron_key(const GenomicFeature &gf)
+{
+   return (uint64_t)gf._genomic_offset << 32 | gf._match_op._len;
+}
+
 bool HitCluster::addHit(const PairedHit &hit){
 
    if(_final){
      return false;
    }
    assert(_ref_id == hit.ref_id());
+   // hit is one fragment, or a collapsed one moved over from another cluster
+   int count = max(1, hit.collapse_count());
+   double mass = hit.collapse_count() > 0 ? hit.collapse_mass() : hit.raw_mass();
    if (hit._left_read && hit._left_read->contains_splice()) {
       vector<GenomicFeature> gfs;
       if (readhit_2_genomicFeats(hit.left_read_obj(), gfs)) {
          for (auto const & gf : gfs) {
             if (gf._match_op._code == Match_t::S_INTRON) {
-               _strand_intron[hit._left_read->strand()][gf]++ ;
+               _strand_intron[(int)hit._left_read->strand()][intron_key(gf)] += count;
             }
          }
       }
@@ -441,7 +464,7 @@ bool HitCluster::addHit(const PairedHit &hit){
       if (readhit_2_genomicFeats(hit.right_read_obj(), gfs)) {
          for (auto const & gf : gfs) {
             if (gf._match_op._code == Match_t::S_INTRON) {
-               _strand_intron[hit._right_read->strand()][gf]++;
+               _strand_intron[(int)hit._right_read->strand()][intron_key(gf)] += count;
             }
          }
       }
@@ -456,7 +479,18 @@ bool HitCluster::addHit(const PairedHit &hit){
             hit.right_read_obj().cigar().back()._type == SOFT_CLIP);
    }
 #endif
-   _hits.push_back(hit);
+   auto ins = _hit_index.insert(make_pair(hit, _hits.size()));
+   if (ins.second) {
+      _hits.push_back(PairedHit(hit._left_read, hit._right_read));
+   }
+   PairedHit &frag = _hits[ins.first->second];
+   if (!ins.second && hit.collapse_count() == 0) {
+      // nothing refers to the reads of a copy once it is folded in
+      if (hit._left_read && hit._left_read != frag._left_read) ReadHitArena::release(hit._left_read);
+      if (hit._right_read && hit._right_read != frag._right_read) ReadHitArena::release(hit._right_read);
+   }
+   frag.add_2_collapse_mass(mass);
+   frag.add_2_collapse_count(count);
    return true;
 }
 
@@ -545,7 +579,7 @@ bool HitCluster::addOpenHit(const ReadHitPtr hit, bool extend_by_hit, bool exten
    }
 
    else{
-     unordered_map<ReadID, list<PairedHit>>::iterator iter_open = _open_mates.find(hit_id);
+     auto iter_open = _open_mates.find(hit_id);
      if( iter_open == _open_mates.end()){
 
 
@@ -557,11 +591,9 @@ bool HitCluster::addOpenHit(const ReadHitPtr hit, bool extend_by_hit, bool exten
             }
          }
          PairedHit open_hit(hit, nullptr);
-         unordered_map<ReadID, list<PairedHit>>::iterator ins_pos;
-         list<PairedHit> chain;
+         SmallVector<PairedHit, 1> chain;
          chain.push_back(move(open_hit));
-         bool status;
-         tie(ins_pos, status) = _open_mates.insert(make_pair(hit_id, chain));
+         bool status = _open_mates.insert(make_pair(hit_id, move(chain))).second;
          assert(status);
        }
        else if(hit->partner_pos() < hit->left()){
@@ -573,11 +605,9 @@ bool HitCluster::addOpenHit(const ReadHitPtr hit, bool extend_by_hit, bool exten
          }
 
          PairedHit open_hit(nullptr, hit);
-         unordered_map<ReadID, list<PairedHit>>::iterator ins_pos;
-         list<PairedHit> chain;
+         SmallVector<PairedHit, 1> chain;
          chain.push_back(move(open_hit));
-         bool status;
-         tie(ins_pos, status) = _open_mates.insert(make_pair(hit_id, chain));
+         bool status = _open_mates.insert(make_pair(hit_id, move(chain))).second;
          assert(status);
        }
        else{ // hit and its partner start at the some position
@@ -657,9 +687,14 @@ void HitCluster::clearOpenMates()
 
 int HitCluster::collapseAndFilterHits()
 {
+   /*
+    * Identical fragments were folded together by addHit() as they arrived.
+    * Drop the ones with an outlying read span and free the per-cluster
+    * index, which is not needed anymore.
+    */
    assert(!_hits.empty());
    assert(_uniq_hits.empty());
-   sort(_hits.begin(), _hits.end());
+   sort_paired_hits(_hits);
    //std::cerr << "hits size" << _hits.size() << std::endl;
    if(_hits.empty())
      return 0;
@@ -680,28 +715,92 @@ int HitCluster::collapseAndFilterHits()
             continue;
          }
       }
-      _hits[i].init_raw_mass();
-      _weighted_mass += _hits[i].raw_mass(); // set cluster mass
-      if(_uniq_hits.empty()){
-         _uniq_hits.push_back(_hits[i]);
-         _uniq_hits.back().add_2_collapse_mass(_hits[i].weighted_mass());
+      _weighted_mass += _hits[i].collapse_mass(); // set cluster mass
+      _uniq_hits.push_back(_hits[i]);
+   }
+   vector<PairedHit>().swap(_hits);
+   _hit_index = FlatHashMap<PairedHit, size_t, PairedHitHash>();
+   //std::cerr << "uniq hits size" << _uniq_hits.size() << std::endl;
+   return _uniq_hits.size();
+}
+
+struct FragSignatureHash {
+   size_t operator()(const vector<uint32_t> &sig) const {
+      uint64_t h = sig.size();
+      for (uint32_t v : sig) h = (h ^ v) * 0x100000001b3ull;
+      return h;
+   }
+};
+
+int HitCluster::downsampleHits(size_t max_frags)
+{
+   /*
+    * Merge fragments that start in the same window of w bp, end in the same
+    * window, agree on mates and strand and have the same intron chain into
+    * the leftmost one, which takes their summed mass. The chain includes
+    * whether each intron has a small anchor (see compute_doc()), so every
+    * IntronTable count is kept exactly and exon coverage only shifts by
+    * less than w at fragment ends. w doubles until the locus has at most
+    * max_frags fragments or reaches kMaxWindow.
+    */
+   const uint kMaxWindow = 64;
+   if (_uniq_hits.size() <= max_frags) return _uniq_hits.size();
+   // intron chain of each fragment, from the same features compute_doc() reads
+   vector<vector<uint32_t>> chains(_uniq_hits.size());
+   for (size_t i = 0; i < _uniq_hits.size(); ++i) {
+      if (!_uniq_hits[i].contains_splice()) continue;
+      const vector<GenomicFeature> &feats = Contig(_uniq_hits[i])._genomic_feats;
+      for (size_t k = 1; k + 1 < feats.size(); ++k) {
+         if (feats[k]._match_op._code != Match_t::S_INTRON) continue;
+         bool small_anchor = feats[k - 1]._match_op._len < kMinAnchor || feats[k + 1]._match_op._len < kMinAnchor;
+         chains[i].push_back(feats[k].left());
+         chains[i].push_back(feats[k].right() << 1 | small_anchor);
       }
-      else{
-         if(_uniq_hits.back() == _hits[i]){
-            _uniq_hits.back().add_2_collapse_mass(_hits[i].weighted_mass());
+   }
+   FlatHashMap<vector<uint32_t>, size_t, FragSignatureHash> groups; // -> merged fragment
+   for (uint w = 2; _uniq_hits.size() > max_frags && w <= kMaxWindow; w *= 2) {
+      vector<PairedHit> merged;
+      vector<vector<uint32_t>> merged_chains;
+      merged.reserve(_uniq_hits.size());
+      uint window = numeric_limits<uint>::max();
+      for (size_t i = 0; i < _uniq_hits.size(); ++i) {
+         const PairedHit &frag = _uniq_hits[i];
+         if (frag.left_pos() / w != window) {
+            window = frag.left_pos() / w;
+            groups.clear();
          }
-         else{
-            _uniq_hits.push_back(_hits[i]);
-            _uniq_hits.back().add_2_collapse_mass(_hits[i].weighted_mass());
+         vector<uint32_t> sig = {frag.right_pos() / w,
+                                 (uint32_t)((frag._left_read != nullptr) << 3 | (frag._right_read != nullptr) << 2 | (int)frag.strand())};
+         sig.insert(sig.end(), chains[i].begin(), chains[i].end());
+         auto ins = groups.insert(make_pair(move(sig), merged.size()));
+         if (ins.second) {
+            merged.push_back(frag);
+            merged_chains.push_back(move(chains[i]));
+         } else {
+            PairedHit &rep = merged[ins.first->second];
+            rep.add_2_collapse_mass(frag.collapse_mass());
+            rep.add_2_collapse_count(frag.collapse_count());
          }
-     }
+      }
+      _uniq_hits.swap(merged);
+      chains.swap(merged_chains);
+   }
+   if (verbose && _uniq_hits.size() > max_frags) {
+      std::cerr << "Locus at " << _leftmost << "-" << _rightmost << " keeps " << _uniq_hits.size()
+                << " fragments after downsampling" << std::endl;
    }
-   //sort(_uniq_hits.begin(),_uniq_hits.end());
-   //_hits.clear();
-   //std::cerr << "uniq hits size" << _uniq_hits.size() << std::endl;
    return _uniq_hits.size();
 }
 
+size_t HitCluster::mem_size() const
+{
+   size_t bytes = sizeof(HitCluster);
+   for (const auto &arena: _arenas) bytes += arena->mem_size();
+   bytes += (_hits.capacity() + _uniq_hits.capacity()) * sizeof(PairedHit);
+   bytes += 2 * _hit_index.size() * sizeof(std::pair<PairedHit, size_t>); // about two slots per entry
+   return bytes;
+}
+
 //void HitCluster::reweight_read()
 //{
 //   // this function is a place holder and does not
@@ -786,15 +885,11 @@ bool HitCluster::overlaps( const HitCluster& rhs) const{
 bool HitCluster::see_both_strands(){
    int plus_count = 0;
    int minus_count = 0;
-   if (_strand_intron.find(Strand_t::StrandPlus) != _strand_intron.end()) {
-      for (auto const& i : _strand_intron.at(Strand_t::StrandPlus)) {
-         plus_count += i.second;
-      }
+   for (auto const& i : _strand_intron[(int)Strand_t::StrandPlus]) {
+      plus_count += i.second;
    }
-   if (_strand_intron.find(Strand_t::StrandMinus) != _strand_intron.end()) {
-      for (auto const& i : _strand_intron.at(Strand_t::StrandMinus)) {
-         minus_count += i.second;
-      }
+   for (auto const& i : _strand_intron[(int)Strand_t::StrandMinus]) {
+      minus_count += i.second;
    }
 
    int minor = std::min(plus_count, minus_count);
@@ -808,14 +903,15 @@ bool HitCluster::see_both_strands(){
    return false;
 }
 
-bool Sample::load_chrom_fasta(RefID seq_id)
+shared_ptr<FaSeqGetter> Sample::fasta_getter(RefID seq_id) const
 {
    /*
-   * Loading reference FASTA sequence without gene model
+   * Reference FASTA sequence of seq_id. Getters read the shared mapping of
+   * the fasta file, so clusters of different chromosomes can use them
+   * concurrently.
    */
-   string seq_name = _hit_factory->_ref_table.ref_real_name(seq_id);
-   _fasta_interface->load2FaSeqGetter(*_fasta_getter, seq_name);
-   return _fasta_getter->loadSeq();
+   if (_fasta_interface == nullptr) return nullptr;
+   return _fasta_interface->getter(_hit_factory->_ref_table.ref_real_name(seq_id));
 }
 
 
@@ -834,10 +930,10 @@ string Sample::get_iso_seq(const shared_ptr<FaSeqGetter> &fa_getter, const Conti
 
 
 
-bool Sample::loadRefmRNAs(vector<unique_ptr<GffTree>> &gseqs, RefSeqTable &rt)
+bool Sample::loadRefmRNAs(vector<AnnotatedSeq> &gseqs, RefSeqTable &rt)
 {
    /*
-   * Parse transcripts in GffTree to a vector of Contig objects.
+   * Parse reference transcripts to a vector of Contig objects.
    */
 
    //sort gseqs accroding to the observation order in ref_table
@@ -845,21 +941,21 @@ bool Sample::loadRefmRNAs(vector<unique_ptr<GffTree>> &gseqs, RefSeqTable &rt)
    //ref_id in ref_table start from 0.
    if(rt.size() == 0){
      for(uint i=0; i<gseqs.size(); ++i){
-       rt.set_id(gseqs[i]->_g_seq_name);
+       rt.set_id(gseqs[i]._name);
      }
    } else{
      int error_count = 0;
      for(uint i = 0; i<gseqs.size(); ++i){
-       int idx = gseqs[i]->get_gseq_id();
-       int ref_table_id = rt.get_id(gseqs[i]->_g_seq_name);
+       int idx = gseqs[i]._gff_seq_id;
+       int ref_table_id = rt.get_id(gseqs[i]._name);
        if (ref_table_id == -1) {
-           cerr<<"Warning: the gff/gtf file contains seq name "<<gseqs[i]->_g_seq_name<<" which is not found in the bam file"<<endl;
+           cerr<<"Warning: the gff/gtf file contains seq name "<<gseqs[i]._name<<" which is not found in the bam file"<<endl;
            error_count++;
        }
        else if(idx != ref_table_id ){
          cerr<<"Warning: Sam file and Gff file are not sorted in the same order!\n";
          cerr<<"set gff chrom id to "<<ref_table_id<<endl;
-         gseqs[i]->set_gseq_id(ref_table_id);
+         gseqs[i]._gff_seq_id = ref_table_id;
        }
      }
       if (error_count == gseqs.size()) {
@@ -867,116 +963,60 @@ bool Sample::loadRefmRNAs(vector<unique_ptr<GffTree>> &gseqs, RefSeqTable &rt)
          exit(0);
       }
      sort(gseqs.begin(),gseqs.end(),
-         [](const unique_ptr<GffTree> &lhs, const unique_ptr<GffTree> &rhs){
-            return lhs->get_gseq_id() < rhs->get_gseq_id();
+         [](const AnnotatedSeq &lhs, const AnnotatedSeq &rhs){
+            return lhs._gff_seq_id < rhs._gff_seq_id;
      });
    }
-//   FaInterface fa_api;
-//   FaSeqGetter *fsg = NULL;
-
-// load sequencing if required
-//   if(seqFile != NULL){
-//     fa_api.initiate(seqFile);
-//   }
    for(uint i = 0; i<gseqs.size(); ++i){// for loop for each chromosome
-     GffTree * gseq = &(*gseqs[i]);
-     int f = 0;
-     int r = 0;
-     int u = 0;
-     RefID ref_id = rt.get_id(gseqs[i]->_g_seq_name);
-     GffmRNA *mrna = NULL;
-     vector<Contig> ref_mrna_for_chr;
-//     if(fa_api.hasLoad()){
-//       delete fsg;
-//       fsg = NULL;
-//       fsg = new FaSeqGetter();
-//       fa_api.load2FaSeqGetter(*fsg,gseqs[i]->_g_seq_name);
-//       if(fsg == NULL){
-//         cerr<<"Reference sequence "<<gseqs[i]->_g_seq_name<<" can not be load!"<<endl;
-//         cerr<<"Please check if the names of sequences in fasta file match the names in BAM/SAM file"<<endl;
-//       }
-//     }
-     int f_total = gseqs[i]->_forward_rnas.size();
-     int r_total = gseqs[i]->_reverse_rnas.size();
-     int u_total = gseqs[i]->_unstranded_rnas.size();
-     while(!(f==f_total && r==r_total && u == u_total)){
-       Strand_t strand;
-       if(f <f_total){
-         mrna = &(*gseqs[i]->_forward_rnas[f++]);
-         strand = Strand_t::StrandPlus;
-       } else if(r < r_total){
-         mrna = &(*gseqs[i]->_reverse_rnas[r++]);
-         strand = Strand_t::StrandMinus;
-       } else{
-         mrna = &(*gseqs[i]->_unstranded_rnas[u++]);
-         strand = Strand_t::StrandUnknown;
-       }
-       if(mrna->_exons.size() == 0){
-         continue;
-       }
-       vector<GenomicFeature> feats;
-       for(uint e = 0; e < mrna->_exons.size(); ++e){
-         GffExon& ex = *(mrna->_exons[e]);
-         feats.push_back(GenomicFeature(Match_t::S_MATCH, ex._iv.left(), ex._iv.right()-ex._iv.left()+1));
-         if( e + 1 < mrna->_exons.size()){
-            GffExon& next_ex  = *(mrna->_exons[e+1]);
-            feats.push_back(GenomicFeature(Match_t::S_INTRON, ex._iv.right()+1, next_ex._iv.left()-1-ex._iv.right() ));
-         }
-       }
-//       for (auto f :feats) {
-//         if (f.right() <= f.left()) {
-//            std::cerr << f << std::endl;
-//         }
-//       }
-       Contig ref_contig(ref_id, 0, strand,1.0, feats, true);
-       ref_contig.annotated_trans_id(mrna->_transcript_id);
-       ref_contig.parent_id() = mrna->getParentGene()->_gene_id;
-       ref_contig.ref_gene_id() = mrna->getParentGene()->_gene_id;
-       ref_contig.ref_gene_name() = mrna->getParentGene()->_gene_name;
+     RefID ref_id = rt.get_id(gseqs[i]._name);
+     for(const auto &mrna : gseqs[i]._transcripts){
+       Contig ref_contig(ref_id, 0, mrna._strand, 1.0, mrna._feats, true);
+       ref_contig.annotated_trans_id(mrna._transcript_id);
+       ref_contig.parent_id() = mrna._gene_id;
+       ref_contig.ref_gene_id() = mrna._gene_id;
+       ref_contig.ref_gene_name() = mrna._gene_name;
        ref_contig.mass(1.0);
-       //cout<<"ref contig left pos "<<ref_contig.left()<<endl;
-       ref_mrna_for_chr.push_back(ref_contig);
-     }// end while loop
-     sort(ref_mrna_for_chr.begin(), ref_mrna_for_chr.end());
-//      for(auto const& ref_contig : ref_mrna_for_chr) {
-//         std::cout << ref_contig << std::endl;
-//         if (ref_contig.left() > 10830000) {
-//            exit(0);
-//         }
-//      }
-     _ref_mRNAs.insert(_ref_mRNAs.end(), ref_mrna_for_chr.begin(), ref_mrna_for_chr.end());
-
-     ref_mrna_for_chr.clear();
+       _ref_mRNAs.push_back(ref_contig);
+     }
    }//end for loop
-
-   //delete fsg;
-   //fsg = NULL;
    return true;
 }
 
 void Sample::inspect_read_len() {
-
+/*
+ * The inspected hits are handed back to the hit factory rather than read
+ * again, so that a stream can be inspected without seeking.
+ */
+   vector<ReadHit> inspected;
    int itnum= 0;
    while(true) {
       if (itnum >= kMaxReadNum4RL) {
          break;
       }
-      ReadHitPtr new_hit(new ReadHit());
-      double mass = next_valid_alignment(*new_hit);
-      //cout<<" hit chr:"<<new_hit->ref_id()<<" hit name "<<new_hit->read_name()<<"\t cluster: "<<clusterOut.left() << "-" << clusterOut.right()<<endl;
-      if (!_hit_factory->recordsRemain()) {
+      ReadHit new_hit;
+      next_valid_alignment(new_hit);
+      //cout<<" hit chr:"<<new_hit.ref_id()<<" hit name "<<new_hit.read_name()<<"\t cluster: "<<clusterOut.left() << "-" << clusterOut.right()<<endl;
+      // The last record may have been read along with the end of the input, so
+      // test the hit itself: only a mapped hit has a reference id.
+      if (new_hit.ref_id() == -1) {
          break;
       }
-      _hit_factory->_reads_table._read_len_abs[new_hit->read_len()]++;
+      _hit_factory->_reads_table._read_len_abs[new_hit.read_len()]++;
+      inspected.push_back(move(new_hit));
       itnum ++;
    }
-   _hit_factory->reset();
+   for (auto it = inspected.rbegin(); it != inspected.rend(); ++it) {
+      _hit_factory->unget_hit(move(*it));
+   }
 }
 
 double Sample::next_valid_alignment(ReadHit& readin){
    const char* hit_buf=NULL;
    size_t hit_buf_size = 0;
    double raw_mass = 0.0;
+   if (_hit_factory->next_ungot_hit(readin)) {
+     return readin.mass();
+   }
    while(true){
      if(!_hit_factory->nextRecord(hit_buf, hit_buf_size)) {
        break;
@@ -1008,11 +1048,9 @@ double Sample::next_valid_alignment(ReadHit& readin){
    return raw_mass;
 }
 
-void Sample::rewindHit()
+void Sample::rewindHit(ReadHit &&hit)
 {
-   //double mass = rh.mass();
-   _hit_factory->undo_hit();
-   //return mass;
+   _hit_factory->unget_hit(move(hit));
 }
 
 void Sample::rewindHits(uint64_t pos)
@@ -1093,9 +1131,7 @@ void Sample::reset_refmRNAs()
    _refmRNA_offset = 0;
    _has_load_all_refs = false;
    if (!no_assembly) {
-      _ref_mRNAs.clear();
-     move(_assembly.begin(), _assembly.end(), back_inserter(_ref_mRNAs));
-     _assembly.clear();
+      _ref_mRNAs = _assembly.release();
      sort(_ref_mRNAs.begin(), _ref_mRNAs.end());
    }
 }
@@ -1107,35 +1143,35 @@ int Sample::nextCluster_denovo(HitCluster &clusterOut,
 {
    if(!_hit_factory->recordsRemain()) return -1;
    while(true){
-     ReadHitPtr new_hit(new ReadHit());
-     double mass = next_valid_alignment(*new_hit);
+     ReadHit new_hit;
+     double mass = next_valid_alignment(new_hit);
 
      if(!_hit_factory->recordsRemain()){
        return clusterOut.size();
      }
 
-     if(new_hit->ref_id() > next_ref_start_ref ||
-      (new_hit->ref_id() == next_ref_start_ref && new_hit->right() >= next_ref_start_pos)){
-       rewindHit();
+     if(new_hit.ref_id() > next_ref_start_ref ||
+      (new_hit.ref_id() == next_ref_start_ref && new_hit.right() >= next_ref_start_pos)){
+       rewindHit(move(new_hit));
        return clusterOut.size();
      }
 
      if(clusterOut.ref_id() == -1){ // add first hit
 
-       clusterOut.addOpenHit(new_hit, true, true);
+       clusterOut.addOpenHit(clusterOut.keep(move(new_hit)), true, true);
        clusterOut.addRawMass(mass);
      } else { //add the rest
-       if(hit_lt_cluster(*new_hit, clusterOut, kMaxOlapDist)){
+       if(hit_lt_cluster(new_hit, clusterOut, kMaxOlapDist)){
          // should never reach here
          std::cerr<<"It appears that SAM/BAM not sorted!\n";
          continue;
        }
-       if(hit_gt_cluster(*new_hit, clusterOut, kMaxOlapDist)){
+       if(hit_gt_cluster(new_hit, clusterOut, kMaxOlapDist)){
          // read has gone to far.
-         rewindHit();
+         rewindHit(move(new_hit));
          break;
        }
-       clusterOut.addOpenHit(new_hit, true, true);
+       clusterOut.addOpenHit(clusterOut.keep(move(new_hit)), true, true);
        clusterOut.addRawMass(mass);
      }
    }
@@ -1157,23 +1193,22 @@ int Sample::nextClusterRefDemand(HitCluster &clusterOut){
    if (num_added_refmRNA == 0) {
      return -1;
    }
-   int64_t first_pos = _hit_factory->getCurrPos();
 //   int counter = 0;
    while (true) {
      if(!_hit_factory->recordsRemain()){
        break;
      }
-     ReadHitPtr new_hit(new ReadHit());
-     double mass = next_valid_alignment(*new_hit);
-     if (hit_lt_cluster(*new_hit, clusterOut, 0)) {  //hit hasn't read this region
+     ReadHit new_hit;
+     double mass = next_valid_alignment(new_hit);
+     if (hit_lt_cluster(new_hit, clusterOut, 0)) {  //hit hasn't read this region
 
-     } else if (hit_gt_cluster(*new_hit, clusterOut, 0)) {
-       rewindHit();
+     } else if (hit_gt_cluster(new_hit, clusterOut, 0)) {
+       rewindHit(move(new_hit));
        break;
-     } else if (new_hit->strand() != Strand_t ::StrandUnknown && new_hit->strand() != clusterOut.ref_strand()) {
+     } else if (new_hit.strand() != Strand_t ::StrandUnknown && new_hit.strand() != clusterOut.ref_strand()) {
      }
      else {
-       clusterOut.addOpenHit(new_hit, false, false);
+       clusterOut.addOpenHit(clusterOut.keep(move(new_hit)), false, false);
        clusterOut.addRawMass(mass);
      }
    }  //end while loop
@@ -1199,17 +1234,12 @@ void Sample::preProcess(FILE *log) {
      if(cluster->ref_id() == -1) continue;
      cluster->_id = ++_num_cluster;
 #if ENABLE_THREADS
-     if(use_threads){
-       while(true){
-         if(curr_thread_num < num_threads){
-            break;
-         }
-         this_thread::sleep_for(chrono::milliseconds(3));
-       }
-       ++curr_thread_num;
+     if(_parallel_clusters){
+       size_t bytes = wait_for_worker(*cluster);
        thread worker ([=] {
          finalizeCluster(cluster, true);
          fragLenDist(ref_t, cluster->ref_mRNAs(), cluster, log);
+         MemoryBudget::release(bytes);
          --curr_thread_num;
        });
        worker.detach();
@@ -1221,7 +1251,7 @@ void Sample::preProcess(FILE *log) {
    } //end while(true)
 
 #if ENABLE_THREADS
-   if(use_threads){
+   if(_parallel_clusters){
      while(true){
        if(curr_thread_num==0){
          break;
@@ -1248,14 +1278,14 @@ int Sample::nextCluster_refGuide(HitCluster &clusterOut)
      }
      //else add as many as alignment possible
      while(true){
-       ReadHitPtr new_hit(new ReadHit());
-       double mass = next_valid_alignment(*new_hit);
-       //cout<<" hit chr:"<<new_hit->ref_id()<<" hit name "<<new_hit->read_name()<<"\t cluster: "<<clusterOut.left() << "-" << clusterOut.right()<<endl;
+       ReadHit new_hit;
+       double mass = next_valid_alignment(new_hit);
+       //cout<<" hit chr:"<<new_hit.ref_id()<<" hit name "<<new_hit.read_name()<<"\t cluster: "<<clusterOut.left() << "-" << clusterOut.right()<<endl;
        if (!_hit_factory->recordsRemain()) {
          break;
        }
-       if(hit_lt_cluster(*new_hit, clusterOut, kMaxOlapDist)){ // hit hasn't reach reference region
-         rewindHit();
+       if(hit_lt_cluster(new_hit, clusterOut, kMaxOlapDist)){ // hit hasn't reach reference region
+         rewindHit(move(new_hit));
          if(_has_load_all_refs){
             rewindReference(clusterOut, num_added_refmRNA);
             return nextCluster_denovo(clusterOut);
@@ -1272,12 +1302,12 @@ int Sample::nextCluster_refGuide(HitCluster &clusterOut)
          }
        }
 
-       if(hit_gt_cluster(*new_hit, clusterOut, kMaxOlapDist)){ // read has gone too far.
-         rewindHit();
+       if(hit_gt_cluster(new_hit, clusterOut, kMaxOlapDist)){ // read has gone too far.
+         rewindHit(move(new_hit));
          break;
        }
 
-       clusterOut.addOpenHit(new_hit, false, false);
+       clusterOut.addOpenHit(clusterOut.keep(move(new_hit)), false, false);
        clusterOut.addRawMass(mass);
      } // end while loop
    } // end loadRefmRNAs
@@ -1289,7 +1319,7 @@ void Sample::mergeClusters(HitCluster & last, HitCluster &cur){
    /*
    * reassign paired hits;
    */
-   sort(last._hits.begin(), last._hits.end());
+   sort_paired_hits(last._hits);
    vector<PairedHit> imcompatible_hits;
    vector<bool> is_imcomp(last._hits.size(), false);
    bool first_incompatible = false;
@@ -1329,10 +1359,15 @@ void Sample::mergeClusters(HitCluster & last, HitCluster &cur){
      if(is_imcomp[i] == false) reduced_hits.push_back(last._hits[i]);
    }
    last._hits = reduced_hits;
+   last._hit_index.clear();
+   for(size_t i = 0; i != last._hits.size(); ++i){
+     last._hit_index.insert(make_pair(last._hits[i], i));
+   }
 
    /*
    * reassign open hits;
    */
+   cur._arenas.insert(cur._arenas.end(), last._arenas.begin(), last._arenas.end());
    for(auto it = last._open_mates.begin(); it != last._open_mates.end(); ++it){
      for(auto hit = it->second.begin(); hit != it->second.end(); ++hit){
        if(hit->_left_read){
@@ -1357,6 +1392,9 @@ void Sample::finalizeCluster(shared_ptr<HitCluster> cluster, bool clear_open_mat
    }
    //cluster->reweight_read(false);
    cluster->collapseAndFilterHits();
+   if (kMaxFragsPerLocus > 0) {
+      cluster->downsampleHits(kMaxFragsPerLocus);
+   }
    cluster->setBoundaries(); // set boundaries if reference exist.
 }
 
@@ -1507,6 +1545,18 @@ vector<Contig> Sample::assembleCluster(const RefSeqTable &ref_t, shared_ptr<HitC
 }
 
 
+// Group hits the way printContext() reads them, so that the hits can be dropped before it runs.
+static FragClasses classify_frags(const LocusContext& est, const vector<Contig> &hits)
+{
+   FragClasses frag_classes;
+   for (size_t i = 0; i < hits.size(); ++i) {
+      auto &c = frag_classes[est.get_frag_class(hits[i])];
+      ++c.first;
+      c.second = i;
+   }
+   return frag_classes;
+}
+
 vector<Isoform> Sample::quantifyCluster(const RefSeqTable &ref_t, const shared_ptr<HitCluster> cluster,
                  const vector<Contig> &assembled_transcripts, FILE *plogfile, FILE *fragfile) const {
 
@@ -1533,7 +1583,12 @@ vector<Isoform> Sample::quantifyCluster(const RefSeqTable &ref_t, const shared_p
           << " finishes abundances estimation" << endl;
       if (fragfile != NULL) {
          //if (est.num_transcripts() > 1 && est.num_exon_bins() > 1) {
-            printContext(est, cluster, _fasta_getter, fragfile);
+         vector<Contig> hits;
+         for (auto r = cluster->uniq_hits().cbegin(); r != cluster->uniq_hits().cend(); ++r) {
+            Contig hit(*r);
+            if (hit.ref_id() != -1) hits.push_back(hit);
+         }
+         printContext(est, classify_frags(est, hits), fasta_getter(cluster->ref_id()), fragfile);
          //}
       }
    }
@@ -1546,19 +1601,27 @@ vector<Isoform> Sample::quantifyCluster(const RefSeqTable &ref_t, const shared_p
 }
 
 
-void Sample::printContext(const LocusContext& est, const shared_ptr<HitCluster> cluster,
+void Sample::printContext(const LocusContext& est, const FragClasses &frag_classes,
                           const std::shared_ptr<FaSeqGetter> & fa_getter, FILE *fragfile) const {
 
-   /* Print locus coordinates*/
+   /*
+    * Print locus coordinates. Fragments compatible with no transcript left in
+    * the locus are skipped, and each path takes the probabilities of its last
+    * fragment.
+    */
    map<set<pair<uint,uint>>, uint> eb_count_map;
-   map<set<pair<uint,uint>>, vector<double>> eb_prob_map;
-   for (auto r = cluster->uniq_hits().cbegin(); r != cluster->uniq_hits().cend(); ++r) {
-      Contig hit = Contig(*r);
-      if (hit.ref_id() == -1) continue;
-      auto eb = est.get_frag_info(hit);
-      if (!eb.first.empty()) {
-         ++eb_count_map[eb.first];
-         eb_prob_map[eb.first] = eb.second;
+   map<set<pair<uint,uint>>, pair<size_t, vector<double>>> eb_prob_map;
+   for (const auto& fc: frag_classes) {
+      const auto &coords = fc.first.first;
+      const auto &iso_ids = fc.first.second;
+      bool compatible = any_of(est.transcripts().cbegin(), est.transcripts().cend(), [&iso_ids](const Isoform &iso) {
+         return find(iso_ids.begin(), iso_ids.end(), iso.id()) != iso_ids.end();
+      });
+      if (coords.empty() || !compatible) continue;
+      eb_count_map[coords] += fc.second.first;
+      auto it = eb_prob_map.find(coords);
+      if (it == eb_prob_map.end() || it->second.first < fc.second.second) {
+         eb_prob_map[coords] = make_pair(fc.second.second, est.get_frag_probs(coords, iso_ids));
       }
    }
 
@@ -1593,7 +1656,7 @@ void Sample::printContext(const LocusContext& est, const shared_ptr<HitCluster>
       info.push_back(fpkms);
 
       string cond_prop;
-      for (const double prob:it->second) {
+      for (const double prob:it->second.second) {
          cond_prop += to_string_with_precision(prob, 12);
          cond_prop += ",";
       }
@@ -1648,7 +1711,7 @@ void Sample::addAssembly(const std::vector<Contig>& assembs) {
    if (use_threads) thread_pool_lock.lock();
 #endif
 
-   if (!assembs.empty()) std::move(assembs.begin(), assembs.end(), std::back_inserter(_assembly));
+   if (!assembs.empty()) _assembly.append(std::vector<Contig>(assembs));
 
 #if ENABLE_THREADS
    if(use_threads) thread_pool_lock.unlock();
@@ -1682,18 +1745,13 @@ void Sample::assembleSample(FILE *plogfile)
      }
 //End loading ref seqs
 #if ENABLE_THREADS
-     if(use_threads){
-       while(true){
-         if(curr_thread_num < num_threads){
-            break;
-         }
-         this_thread::sleep_for(chrono::milliseconds(3));
-       }
-       ++curr_thread_num;
+     if(_parallel_clusters){
+       size_t bytes = wait_for_worker(*cur_cluster);
        thread worker ([=] {
             finalizeCluster(cur_cluster, true);
             vector<Contig> asmb = this-> assembleCluster(ref_t, cur_cluster, plogfile);
             this->addAssembly(asmb);
+            MemoryBudget::release(bytes);
             decr_pool_count();
             });
        //thread worker{&Sample::finalizeAndassembleCluster, this, ref_t, cur_cluster, NULL, NULL};
@@ -1717,7 +1775,7 @@ void Sample::assembleSample(FILE *plogfile)
 
 //make sure all threads have finished
 #if ENABLE_THREADS
-   if(use_threads){
+   if(_parallel_clusters){
      while(true){
        if(curr_thread_num==0){
          break;
@@ -1733,23 +1791,47 @@ int Sample::total_mapped_reads() const
    return _total_mapped_reads;
 }
 
+static void print_context_header(FILE *fragfile)
+{
+   std::vector<string> header = {"sample", "sample_frag_count", "gene_id", "gene_frag_count",
+   "transcripts", "FPKMs", "conditional_probabilities", "class_probabilities", "path_symbol", "path_count",
+   "path_gc_content", "path_hexmer_entropy", "gc_stretch_0.8_20", "gc_stretch_0.9_20", "gc_stretch_0.8_40",
+   "gc_stretch_0.9_40"};
+   pretty_print(fragfile, header, "\t");
+}
+
+static void print_isoforms(FILE *pfile, const RefSeqTable &ref_t, SpillVector<Isoform> &isoforms)
+{
+   double total_fpkm = 0.0;
+   isoforms.for_each([&total_fpkm](const Isoform &iso) {
+      total_fpkm += iso._FPKM;
+   });
+   isoforms.for_each([&](Isoform &iso) {
+
+      iso._TPM = 1e6 * iso._FPKM / total_fpkm;
+      iso._TPM_s = to_string(iso._TPM);
+      iso._contig.print2gtf(pfile, ref_t, iso._FPKM_s,
+                              iso._frac_s, iso._TPM_s, iso._gene_str, iso._isoform_str, iso._ref_gene_id, iso._ref_gene_name);
+   });
+}
+
 void Sample::procSample(FILE *pfile, FILE *plogfile, FILE *fragfile)
+{
+   if (fragfile != NULL) {
+      print_context_header(fragfile);
+   }
+   SpillVector<Isoform> isoforms = quantifySample(plogfile, fragfile);
+   print_isoforms(pfile, _hit_factory->_ref_table, isoforms);
+}
+
+SpillVector<Isoform> Sample::quantifySample(FILE *plogfile, FILE *fragfile)
 {
 /*
  */
    _hit_factory->reset();
-   vector<Isoform> isoforms;
-   isoforms.reserve(1024);
+   SpillVector<Isoform> isoforms;
    reset_refmRNAs();
    const RefSeqTable & ref_t = _hit_factory->_ref_table;
-   int current_ref_id = INT_MAX;
-   if (fragfile != NULL) {
-      std::vector<string> header = {"sample", "sample_frag_count", "gene_id", "gene_frag_count",
-      "transcripts", "FPKMs", "conditional_probabilities", "class_probabilities", "path_symbol", "path_count",
-      "path_gc_content", "path_hexmer_entropy", "gc_stretch_0.8_20", "gc_stretch_0.9_20", "gc_stretch_0.8_40",
-      "gc_stretch_0.9_40"};
-      pretty_print(fragfile, header, "\t");
-   }
 
    while(true){
      //++_num_cluster;
@@ -1759,48 +1841,24 @@ void Sample::procSample(FILE *pfile, FILE *plogfile, FILE *fragfile)
      }
      if(cluster->ref_id() == -1) continue;
 
-      //begin load fasta genome
-     if(current_ref_id != cluster->ref_id()){
-       current_ref_id = cluster->ref_id();
-       if(BIAS_CORRECTION){
 #if ENABLE_THREADS
-         if(use_threads){
-            while(true){
-              if(curr_thread_num==0){
-                break;
-              }
-              this_thread::sleep_for(chrono::milliseconds(3));
-            }
-            load_chrom_fasta(current_ref_id);
-         }
-#endif
-         load_chrom_fasta(current_ref_id);
-       }
-     }
-     //end load fasta genome
-#if ENABLE_THREADS
-     if(use_threads){
-       while(true){
-         if(curr_thread_num < num_threads){
-            break;
-         }
-         this_thread::sleep_for(chrono::milliseconds(3));
-       }
-       ++curr_thread_num;
-       thread worker ([&isoforms, this, ref_t, cluster, plogfile, fragfile] {
+     if(_parallel_clusters){
+       size_t bytes = wait_for_worker(*cluster);
+       thread worker ([&isoforms, this, ref_t, cluster, plogfile, fragfile, bytes] {
             finalizeCluster(cluster, true);
             auto iso = quantifyCluster(ref_t, cluster, cluster->ref_mRNAs(), plogfile, fragfile);
 
             out_file_lock.lock();
-            isoforms.insert(isoforms.end(), iso.begin(), iso.end());
+            isoforms.append(move(iso));
             out_file_lock.unlock();
+            MemoryBudget::release(bytes);
             decr_pool_count();
        });
        worker.detach();
      }else {
        finalizeCluster(cluster, true);
        auto iso = quantifyCluster(ref_t, cluster, cluster->ref_mRNAs(), plogfile, fragfile);
-       isoforms.insert(isoforms.end(), iso.begin(), iso.end());
+       isoforms.append(move(iso));
      }
 #else
      finalizeCluster(cluster, true);
@@ -1809,7 +1867,7 @@ void Sample::procSample(FILE *pfile, FILE *plogfile, FILE *fragfile)
    } //end while(true)
 
 #if ENABLE_THREADS
-   if(use_threads){
+   if(_parallel_clusters){
      while(true){
        if(curr_thread_num==0){
          break;
@@ -1818,22 +1876,419 @@ void Sample::procSample(FILE *pfile, FILE *plogfile, FILE *fragfile)
      }
    }
 #endif
-   double total_fpkm = 0.0;
-   for (const auto & iso : isoforms) {
-      total_fpkm += iso._FPKM;
+   return isoforms;
+}
+
+void Sample::streamSample(FILE *plogfile, bool keep_frags)
+/*
+ * Single-pass alternative to assembleSample()/preProcess() followed by procSample().
+ * Each cluster is assembled (or matched to the reference models with -r) and its
+ * fragments are assigned to exon bins while its reads are still in memory.
+ * Abundance estimation needs the total mapped mass and the fragment length
+ * distribution of the whole sample, so it is deferred to procPendingLoci().
+ */
+{
+   const RefSeqTable & ref_t = _hit_factory->_ref_table;
+   curr_thread_num = 0;
+   _num_cluster = 0;
+
+   while(true){
+     shared_ptr<HitCluster> cluster (new HitCluster());
+     int ret = no_assembly ? nextClusterRefDemand(*cluster) : nextCluster_refGuide(*cluster);
+     if(-1 == ret){
+       break;
+     }
+     if(cluster->ref_id() == -1){
+       continue;
+     }
+     if(no_assembly){
+       cluster->_id = ++_num_cluster;
+     } else if(_current_chrom != ref_t.ref_real_name(cluster->ref_id())){
+       _current_chrom = ref_t.ref_real_name(cluster->ref_id());
+     }
+
+     auto process = [=] {
+       finalizeCluster(cluster, true);
+       if(no_assembly){
+         fragLenDist(ref_t, cluster->ref_mRNAs(), cluster, plogfile);
+         deferQuant(cluster, cluster->ref_mRNAs(), plogfile, keep_frags);
+       } else{
+         vector<Contig> asmb = assembleCluster(ref_t, cluster, plogfile);
+         deferQuant(cluster, asmb, plogfile, keep_frags);
+       }
+     };
+#if ENABLE_THREADS
+     if(_parallel_clusters){
+       size_t bytes = wait_for_worker(*cluster);
+       thread worker ([=] {
+            process();
+            MemoryBudget::release(bytes);
+            decr_pool_count();
+            });
+       worker.detach();
+     }else{
+       process();
+     }
+#else
+     process();
+#endif
    }
-   for (auto & iso: isoforms) {
 
-      iso._TPM = 1e6 * iso._FPKM / total_fpkm;
-      iso._TPM_s = to_string(iso._TPM);
+#if ENABLE_THREADS
+   if(_parallel_clusters){
+     while(true){
+       if(curr_thread_num==0){
+         break;
+       }
+       this_thread::sleep_for(chrono::milliseconds(3));
+     }
    }
+#endif
+}
 
-  for (const auto &iso: isoforms) {
-     iso._contig.print2gtf(pfile, _hit_factory->_ref_table, iso._FPKM_s,
-                              iso._frac_s, iso._TPM_s, iso._gene_str, iso._isoform_str, iso._ref_gene_id, iso._ref_gene_name);
-  }
+void Sample::deferQuant(const shared_ptr<HitCluster> cluster, const vector<Contig> &transcripts,
+                        FILE *plogfile, bool keep_frags)
+{
+   if (transcripts.empty()) {
+      return;
+   }
+   vector<Contig> hits;
+   for (auto r = cluster->uniq_hits().cbegin(); r != cluster->uniq_hits().cend(); ++r) {
+      Contig hit(*r);
+      if (hit.ref_id() != -1) hits.push_back(hit);
+   }
+
+   /*
+    * Transcripts of one cluster may belong to several loci (one per segment).
+    * Split them by parent id and give each locus, as procSample() would,
+    * the fragments within its span that are not on the opposite strand.
+    * A cluster with a single locus is filtered the same way.
+    */
+   vector<PendingLocus> loci;
+   size_t first = 0;
+   while (first < transcripts.size()) {
+      size_t last = first + 1;
+      while (last < transcripts.size() && transcripts[last].parent_id() == transcripts[first].parent_id()) {
+         ++last;
+      }
+      vector<Contig> locus_trans(transcripts.begin() + first, transcripts.begin() + last);
+      uint left = std::numeric_limits<uint>::max();
+      uint right = 0;
+      for (const auto& t: locus_trans) {
+         left = min(left, t.left());
+         right = max(right, t.right());
+      }
+      Strand_t strand = locus_trans.front().strand();
+      vector<Contig> locus_hits;
+      for (const auto& h: hits) {
+         if (h.right() < left || h.left() > right) continue;
+         if (h.strand() != Strand_t::StrandUnknown && h.strand() != strand) continue;
+         locus_hits.push_back(h);
+      }
+      shared_ptr<LocusContext> est(new LocusContext(*this, plogfile, locus_hits, locus_trans));
+      loci.emplace_back(locus_trans.front().ref_id(), left, right, move(est));
+      if (keep_frags) {
+         loci.back().frag_classes = classify_frags(*loci.back().est, locus_hits);
+      }
+      first = last;
+   }
+
+#if ENABLE_THREADS
+   if (use_threads) thread_pool_lock.lock();
+#endif
+   move(loci.begin(), loci.end(), back_inserter(_pending_loci));
+#if ENABLE_THREADS
+   if (use_threads) thread_pool_lock.unlock();
+#endif
+}
+
+void Sample::procPendingLoci(FILE *pfile, FILE *plogfile, FILE *fragfile)
+/*
+ * Deferred normalization step of the single-pass workflow. The insert size
+ * distribution and total mapped reads are final at this point.
+ */
+{
+   SpillVector<Isoform> isoforms;
+   const RefSeqTable & ref_t = _hit_factory->_ref_table;
+   if (fragfile != NULL) {
+      print_context_header(fragfile);
+   }
+   sort(_pending_loci.begin(), _pending_loci.end(),
+        [](const PendingLocus &lhs, const PendingLocus &rhs) {
+           if (lhs.ref_id != rhs.ref_id) return lhs.ref_id < rhs.ref_id;
+           return lhs.left < rhs.left;
+        });
+
+   auto quantify = [&isoforms, &ref_t, this, fragfile](PendingLocus &locus) {
+      locus.est->set_bin_weight();
+      bool success = locus.est->estimate_abundances();
+#if ENABLE_THREADS
+      if(use_threads) {
+         out_file_lock.lock();
+      }
+#endif
+      if (success) {
+         cerr << ref_t.ref_real_name(locus.ref_id) << "\t" << locus.left << "\t" << locus.right
+              << " finishes abundances estimation" << endl;
+         if (fragfile != NULL) {
+            printContext(*locus.est, locus.frag_classes, fasta_getter(locus.ref_id), fragfile);
+         }
+         isoforms.append(vector<Isoform>(locus.est->transcripts()));
+      }
+#if ENABLE_THREADS
+      if(use_threads) {
+         out_file_lock.unlock();
+      }
+#endif
+      locus.est.reset();
+      locus.frag_classes.clear();
+   };
+
+   for (auto &locus : _pending_loci) {
+#if ENABLE_THREADS
+      if(_parallel_clusters){
+         while(true){
+            if(curr_thread_num < num_threads){
+               break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(3));
+         }
+         ++curr_thread_num;
+         PendingLocus *locus_p = &locus;
+         thread worker ([=] {
+            quantify(*locus_p);
+            decr_pool_count();
+         });
+         worker.detach();
+      }else {
+         quantify(locus);
+      }
+#else
+      quantify(locus);
+#endif
+   }
+
+#if ENABLE_THREADS
+   if(_parallel_clusters){
+     while(true){
+       if(curr_thread_num==0){
+         break;
+       }
+       this_thread::sleep_for(chrono::milliseconds(5));
+     }
+   }
+#endif
+   _pending_loci.clear();
+   print_isoforms(pfile, ref_t, isoforms);
+}
+
+
+bool Sample::loadBamIndex()
+{
+   auto bam_factory = dynamic_pointer_cast<BAMHitFactory>(_hit_factory);
+   return bam_factory && bam_factory->load_index();
 }
 
+unique_ptr<Sample> Sample::makeShard(BAMHitFactory &whole_file, int tid) const
+/*
+ * A shard is a Sample reading only reference sequence tid through the BAM index.
+ * It runs its clusters one after another in the calling thread.
+ */
+{
+   unique_ptr<ReadTable> reads(new ReadTable());
+   reads->_read_len_abs = _hit_factory->_reads_table._read_len_abs;
+   shared_ptr<HitFactory> hf(new BAMHitFactory(whole_file, *reads, tid));
+   unique_ptr<Sample> shard(new Sample(move(hf)));
+   shard->_shard_reads = move(reads);
+   shard->_parallel_clusters = false;
+   shard->_kmer_bias = _kmer_bias;
+   return shard;
+}
+
+static vector<vector<Contig>> split_by_shard(BAMHitFactory &whole_file, const vector<Contig> &contigs)
+{
+   vector<vector<Contig>> result(whole_file.num_targets());
+   unordered_map<RefID, int> shard_of_ref;
+   for (int tid = 0; tid < whole_file.num_targets(); ++tid) {
+      shard_of_ref[whole_file.target_ref_id(tid)] = tid;
+   }
+   for (const auto &c: contigs) {
+      auto it = shard_of_ref.find(c.ref_id());
+      if (it != shard_of_ref.end()) result[it->second].push_back(c);
+   }
+   return result;
+}
+
+bool Sample::inspectByIndex()
+/*
+ * Pre-inspection through the BAM index. Instead of the first reads of the
+ * file, which all come from the start of the first reference sequence, reads
+ * are taken at pseudo-random positions spread over all reference sequences
+ * in proportion to their lengths, and reading starts at the linear index
+ * offset of each point. Points are read in parallel with -p.
+ * Spliced reads with an XS strand are also used to report the library type.
+ * Returns false when the input has no index.
+ */
+{
+   auto bam_factory = dynamic_pointer_cast<BAMHitFactory>(_hit_factory);
+   if (!bam_factory || !bam_factory->seekable() || !bam_factory->load_index()) {
+      return false;
+   }
+   BAMHitFactory &whole_file = *bam_factory;
+
+   vector<uint64_t> ref_start(whole_file.num_targets() + 1, 0);
+   for (int tid = 0; tid < whole_file.num_targets(); ++tid) {
+      ref_start[tid + 1] = ref_start[tid] + whole_file.target_len(tid);
+   }
+   if (ref_start.back() == 0) return false;
+   const int num_points = min(1024, max(1, kMaxReadNum4RL / 50));
+   const int reads_per_point = max(1, kMaxReadNum4RL / num_points);
+   const int kSampleWindow = 100000; // reads are taken from this many bases after each point
+   const int kLinearIndexShift = 14; // BAM linear index window of 16kb
+   mt19937_64 rng(0);
+   uniform_int_distribution<uint64_t> genome_pos(0, ref_start.back() - 1);
+   map<pair<int, int>, int> points; // (tid, pos) -> number of draws
+   for (int i = 0; i < num_points; ++i) {
+      uint64_t g = genome_pos(rng);
+      int tid = upper_bound(ref_start.begin(), ref_start.end(), g) - ref_start.begin() - 1;
+      // start at a linear index window, where reading starts, so no records are skipped
+      int pos = ((g - ref_start[tid]) >> kLinearIndexShift) << kLinearIndexShift;
+      points[make_pair(tid, pos)]++;
+   }
+   vector<pair<pair<int, int>, int>> sorted_points(points.begin(), points.end());
+
+   struct Tally {
+      unordered_map<uint, uint> read_len;
+      int fr = 0;
+      int rf = 0;
+   };
+   const int num_chunks = min<int>(sorted_points.size(), 16);
+   vector<Tally> tallies(num_chunks);
+   run_shards(num_chunks, [&](int chunk) {
+      size_t first = sorted_points.size() * chunk / num_chunks;
+      size_t last = sorted_points.size() * (chunk + 1) / num_chunks;
+      ReadTable reads;
+      BAMHitFactory region(whole_file, reads, sorted_points[first].first.first);
+      Tally &tally = tallies[chunk];
+      for (size_t p = first; p < last; ++p) {
+         int tid = sorted_points[p].first.first;
+         int pos = sorted_points[p].first.second;
+         region.set_region(tid, pos, min<uint64_t>(pos + kSampleWindow, whole_file.target_len(tid)));
+         const char* buf = NULL;
+         size_t buf_size = 0;
+         int num_reads = 0;
+         while (num_reads < reads_per_point * sorted_points[p].second && region.nextRecord(buf, buf_size)) {
+            ReadHit hit;
+            if (!region.getHitFromBuf(buf, hit) || hit.ref_id() == -1) continue;
+            ++num_reads;
+            tally.read_len[hit.read_len()]++;
+            if (hit.contains_splice() && hit.strand() != Strand_t::StrandUnknown) {
+               bool first_forward = hit.is_second() ? hit.reverseCompl() : !hit.reverseCompl();
+               if (first_forward == (hit.strand() == Strand_t::StrandPlus)) tally.fr++;
+               else tally.rf++;
+            }
+         }
+      }
+   });
+
+   int fr = 0, rf = 0;
+   for (const auto &tally : tallies) {
+      for (const auto &len : tally.read_len) {
+         _hit_factory->_reads_table._read_len_abs[len.first] += len.second;
+      }
+      fr += tally.fr;
+      rf += tally.rf;
+   }
+   if (!fr_strand && !rf_strand && fr + rf >= 100) {
+      double fr_frac = (double) fr / (fr + rf);
+      const char *type = fr_frac > 0.9 ? "fr-secondstrand (--fr)" : fr_frac < 0.1 ? "rf-firststrand (--rf)" :
+                         fabs(fr_frac - 0.5) < 0.1 ? "unstranded" : "undetermined";
+      cerr << "Library type inferred from " << fr + rf << " sampled spliced reads (" << fr_frac * 100
+           << "% fr): " << type << endl;
+   }
+   return true;
+}
+
+void Sample::assembleShards(FILE *plogfile)
+/*
+ * Same as assembleSample() (or preProcess() with -r) but reference sequences
+ * are processed concurrently, one shard per sequence. loadBamIndex() must
+ * have succeeded. Clusters never span two sequences so shards need no
+ * stitching. Assembled genes are renumbered in coordinate order afterwards
+ * so that the ids do not depend on thread scheduling.
+ */
+{
+   BAMHitFactory &whole_file = dynamic_cast<BAMHitFactory&>(*_hit_factory);
+   const int num_shards = whole_file.num_targets();
+   vector<vector<Contig>> refs_by_shard = split_by_shard(whole_file, _ref_mRNAs);
+
+   vector<SpillVector<Contig>> assembly_by_shard(num_shards);
+   mutex merge_lock;
+   run_shards(num_shards, [&](int tid) {
+      unique_ptr<Sample> shard = makeShard(whole_file, tid);
+      shard->_ref_mRNAs = move(refs_by_shard[tid]);
+      if (no_assembly) shard->preProcess(plogfile);
+      else shard->assembleSample(plogfile);
+      assembly_by_shard[tid] = move(shard->_assembly);
+      lock_guard<mutex> lk(merge_lock);
+      _total_mapped_reads += shard->_total_mapped_reads;
+      const vector<int> &fd = shard->_hit_factory->_reads_table._frag_dist;
+      _hit_factory->_reads_table._frag_dist.insert(_hit_factory->_reads_table._frag_dist.end(), fd.begin(), fd.end());
+   });
+
+   int gene_num = 0;
+   for (auto &shard_assembly: assembly_by_shard) {
+      vector<Contig> assembly = shard_assembly.release();
+      sort(assembly.begin(), assembly.end());
+      unordered_map<string, pair<string, int>> renamed; // old gene id -> new gene id, number of transcripts
+      for (Contig &asmb: assembly) {
+         auto it = renamed.find(asmb.parent_id());
+         if (it == renamed.end()) {
+            it = renamed.emplace(asmb.parent_id(), make_pair(sample_name() + "." + to_string(++gene_num), 0)).first;
+         }
+         asmb.parent_id() = it->second.first;
+         asmb.annotated_trans_id(asmb.parent_id() + "." + to_string(++it->second.second));
+      }
+      _assembly.append(move(assembly));
+   }
+}
+
+void Sample::procShards(FILE *pfile, FILE *plogfile, FILE *fragfile)
+/*
+ * Sharded counterpart of procSample(). Isoforms are printed in the order of
+ * the reference sequences in the BAM header.
+ */
+{
+   BAMHitFactory &whole_file = dynamic_cast<BAMHitFactory&>(*_hit_factory);
+   const int num_shards = whole_file.num_targets();
+   reset_refmRNAs();
+   vector<vector<Contig>> refs_by_shard = split_by_shard(whole_file, _ref_mRNAs);
+   if (fragfile != NULL) {
+      print_context_header(fragfile);
+   }
+
+   vector<SpillVector<Isoform>> isoforms_by_shard(num_shards);
+   run_shards(num_shards, [&](int tid) {
+      if (refs_by_shard[tid].empty()) return;
+      unique_ptr<Sample> shard = makeShard(whole_file, tid);
+      if (no_assembly) shard->_ref_mRNAs = move(refs_by_shard[tid]);
+      else shard->_assembly.append(move(refs_by_shard[tid]));
+      shard->_insert_size_dist = _insert_size_dist;
+      shard->_total_mapped_reads = (int) _total_mapped_reads;
+      shard->_fasta_interface = _fasta_interface;
+      vector<Isoform> isoforms = shard->quantifySample(plogfile, fragfile).release();
+      stable_sort(isoforms.begin(), isoforms.end(),
+                  [](const Isoform &lhs, const Isoform &rhs) {return lhs._contig < rhs._contig;});
+      isoforms_by_shard[tid].append(move(isoforms));
+   });
+
+   SpillVector<Isoform> isoforms;
+   for (auto &shard_isoforms: isoforms_by_shard) {
+      shard_isoforms.for_each([&isoforms](Isoform &iso) { isoforms.push_back(move(iso)); });
+      shard_isoforms.clear();
+   }
+   print_isoforms(pfile, _hit_factory->_ref_table, isoforms);
+}
 
 double compute_doc(const uint left, const uint right,
                    const vector<Contig> & hits,
@@ -0,0 +1,212 @@
+/*
+ * annotation_cache.cpp
+ *
+ * See annotation_cache.h.
+ */
+
+#include "annotation_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace std;
+
+static const char kCacheMagic[8] = {'S', 'T', 'R', 'B', 'G', 'T', 'F', '2'};
+static const size_t kMagicVersion = 7; // index of the format version in kCacheMagic
+
+struct CacheHeader {
+   char magic[8];
+   uint64_t annotation_size; // size and modification time of the annotation file
+   int64_t annotation_mtime;
+   uint32_t num_seqs; // followed by the canonical path of the annotation file, then num_seqs sequences
+   uint32_t pad;
+};
+
+// Each sequence is its name, then SeqRecord, then num_transcripts of
+// TranscriptRecord, (offset, length) feature pairs and the three ids.
+struct SeqRecord {
+   int32_t gff_seq_id;
+   uint32_t num_transcripts;
+};
+
+struct TranscriptRecord {
+   uint8_t strand;
+   uint8_t pad[3];
+   uint32_t num_feats;
+};
+
+// Header for annotation_file and its canonical path; false if it is not a readable file.
+static bool annotation_stat(const string &annotation_file, CacheHeader &h, string &path)
+{
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+   path = fileIdentity(annotation_file, h.annotation_size, h.annotation_mtime);
+   return fileExists(annotation_file.c_str()) == 2;
+}
+
+bool AnnotationCache::write(const vector<AnnotatedSeq> &gseqs,
+                            const string &annotation_file,
+                            const string &cache_file_name)
+{
+   CacheHeader header;
+   string annotation_path;
+   if (!annotation_stat(annotation_file, header, annotation_path)) {
+      cerr << "Cannot stat annotation file " << annotation_file << endl;
+      return false;
+   }
+   // written under a temporary name so that an interrupted run leaves no cache behind
+   string tmp_name = cache_file_name + ".tmp";
+   FILE* out = fopen(tmp_name.c_str(), "wb");
+   if (out == NULL) {
+      cerr << "Cannot create annotation cache " << cache_file_name << endl;
+      return false;
+   }
+   bool ok = true;
+   auto put = [&ok, out](const void* src, size_t len) {
+      if (ok && len > 0 && fwrite(src, 1, len, out) != len) ok = false;
+   };
+   auto put_string = [&put](const string &str) {
+      uint32_t len = str.size();
+      put(&len, sizeof(len));
+      put(str.data(), len);
+   };
+   header.num_seqs = gseqs.size();
+   put(&header, sizeof(header));
+   put_string(annotation_path);
+   vector<uint32_t> feats;
+   for (const auto &seq : gseqs) {
+      put_string(seq._name);
+      SeqRecord s;
+      s.gff_seq_id = seq._gff_seq_id;
+      s.num_transcripts = seq._transcripts.size();
+      put(&s, sizeof(s));
+      for (const auto &mrna : seq._transcripts) {
+         TranscriptRecord t;
+         memset(&t, 0, sizeof(t));
+         t.strand = static_cast<uint8_t>(mrna._strand);
+         t.num_feats = mrna._feats.size();
+         put(&t, sizeof(t));
+         feats.clear();
+         for (const auto &f : mrna._feats) {
+            feats.push_back(f.left());
+            feats.push_back((uint32_t)f._match_op._len << 2 | f._match_op._code);
+         }
+         put(feats.data(), feats.size() * sizeof(uint32_t));
+         put_string(mrna._transcript_id);
+         put_string(mrna._gene_id);
+         put_string(mrna._gene_name);
+      }
+   }
+   bool closed = fclose(out) == 0;
+   if (!ok || !closed || rename(tmp_name.c_str(), cache_file_name.c_str()) != 0) {
+      cerr << "Fail to write annotation cache " << cache_file_name << endl;
+      unlink(tmp_name.c_str());
+      return false;
+   }
+   return true;
+}
+
+namespace {
+/*
+ * Bounds checked reader over the mapped cache.
+ */
+class CacheCursor {
+   const char* _data;
+   size_t _size;
+   size_t _offset = 0;
+public:
+   CacheCursor(const char* data, size_t size): _data(data), _size(size) {}
+   bool get(void* dst, size_t len) {
+      if (_offset + len > _size) return false;
+      memcpy(dst, _data + _offset, len);
+      _offset += len;
+      return true;
+   }
+   bool get(string &s) {
+      uint32_t len;
+      if (!get(&len, sizeof(len)) || _offset + len > _size) return false;
+      s.assign(_data + _offset, len);
+      _offset += len;
+      return true;
+   }
+};
+}
+
+vector<AnnotatedSeq> AnnotationCache::read(const string &annotation_file,
+                                           const string &cache_file_name)
+{
+   int fd = open(cache_file_name.c_str(), O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+      cerr << "Fail to open annotation cache " << cache_file_name << endl;
+      exit(1);
+   }
+   size_t size = st.st_size;
+   void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      cerr << "Fail to map annotation cache " << cache_file_name << endl;
+      exit(1);
+   }
+   madvise(p, size, MADV_SEQUENTIAL);
+   CacheCursor cursor((const char*)p, size);
+
+   CacheHeader header, expected;
+   string path, expected_path;
+   cursor.get(&header, sizeof(header));
+   if (memcmp(header.magic, kCacheMagic, kMagicVersion) != 0) {
+      cerr << cache_file_name << " is not a Strawberry annotation cache" << endl;
+      exit(1);
+   }
+   if (header.magic[kMagicVersion] != kCacheMagic[kMagicVersion]) {
+      cerr << "Annotation cache " << cache_file_name << " was built by another version of Strawberry."
+           << " Remove it to rebuild." << endl;
+      exit(1);
+   }
+   if (!cursor.get(path)) {
+      cerr << "Annotation cache " << cache_file_name << " is truncated." << endl;
+      exit(1);
+   }
+   if (!annotation_stat(annotation_file, expected, expected_path) || path != expected_path ||
+       header.annotation_size != expected.annotation_size ||
+       header.annotation_mtime != expected.annotation_mtime) {
+      cerr << "Annotation cache " << cache_file_name << " was not built from the current "
+           << annotation_file << ". Remove it to rebuild." << endl;
+      exit(1);
+   }
+
+   vector<AnnotatedSeq> gseqs(header.num_seqs);
+   bool ok = true;
+   vector<uint32_t> feats;
+   for (auto &seq : gseqs) {
+      SeqRecord s;
+      ok = ok && cursor.get(seq._name) && cursor.get(&s, sizeof(s));
+      if (!ok) break;
+      seq._gff_seq_id = s.gff_seq_id;
+      seq._transcripts.resize(s.num_transcripts);
+      for (auto &mrna : seq._transcripts) {
+         TranscriptRecord t;
+         ok = ok && cursor.get(&t, sizeof(t));
+         if (!ok) break;
+         mrna._strand = static_cast<Strand_t>(t.strand);
+         feats.resize(2 * t.num_feats);
+         ok = ok && cursor.get(feats.data(), feats.size() * sizeof(uint32_t));
+         ok = ok && cursor.get(mrna._transcript_id) && cursor.get(mrna._gene_id) && cursor.get(mrna._gene_name);
+         if (!ok) break;
+         mrna._feats.reserve(t.num_feats);
+         for (uint32_t i = 0; i < t.num_feats; ++i) {
+            mrna._feats.push_back(GenomicFeature((Match_t)(feats[2 * i + 1] & 3), feats[2 * i], feats[2 * i + 1] >> 2));
+         }
+      }
+      if (!ok) break;
+   }
+   munmap(p, size);
+   if (!ok) {
+      cerr << "Annotation cache " << cache_file_name << " is truncated." << endl;
+      exit(1);
+   }
+   return gseqs;
+}
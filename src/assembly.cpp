@@ -172,7 +172,7 @@ void FlowNetwork::flowDecompose(const Graph &g,
 }
 
 void FlowNetwork::remove_low_cov_exon(const int cluster_left, const std::vector<float>& exon_doc,
-                                      const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+                                      const IntronMap &intron_counter,
                             std::list<std::pair<uint,uint>>& exon_boundaries)
 {
    std::vector<double> exon_covs(exon_boundaries.size());
@@ -315,7 +315,7 @@ void FlowNetwork::filter_exon_segs(const std::vector<std::pair<uint,uint>>& pair
 }
 
 void FlowNetwork::filter_intron(const std::vector<GenomicFeature> &exons,
-         std::map<std::pair<uint,uint>, IntronTable> &intron_counter)
+         IntronMap &intron_counter)
 {
    auto it = intron_counter.begin();
    //std::cerr<<"has exon: "<<exons<<std::endl;
@@ -340,7 +340,7 @@ void FlowNetwork::filter_intron(const std::vector<GenomicFeature> &exons,
 }
 
 bool FlowNetwork::splicingGraph(const RefID & ref_id, const int &left, const std::vector<float> &exon_doc,
-      std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+      IntronMap &intron_counter,
       std::vector<GenomicFeature> &exons)
 {
    /*
@@ -549,7 +549,7 @@ bool FlowNetwork::splicingGraph(const RefID & ref_id, const int &left, const std
 bool FlowNetwork::createNetwork(
       const std::vector<Contig> &hits,
       const std::vector<GenomicFeature> &exons,
-      const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+      const IntronMap &intron_counter,
       Graph::NodeMap<const GenomicFeature*> &node2feat,
       Graph::ArcMap<int> &cost_map,
       Graph::ArcMap<int> &min_flow_map,
@@ -765,7 +765,7 @@ bool FlowNetwork::createNetwork(
 }
 
 void FlowNetwork::addWeight(const std::vector<Contig> &hits,
-      const std::map<std::pair<uint,uint>, IntronTable> &intron_counter,
+      const IntronMap &intron_counter,
       const Graph::NodeMap<const GenomicFeature*> &node_map,
       Graph::ArcMap<int> &arc_map)
 {
@@ -0,0 +1,293 @@
+/*
+ * bgzf_reader.cpp
+ *
+ * See bgzf_reader.h.
+ */
+
+#include "bgzf_reader.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <iostream>
+#include <algorithm>
+#include "sam/bgzf.h"
+
+using namespace std;
+
+static const int kBlockHeaderLen = 18;
+
+static inline int unpackInt16(const uint8_t *buffer)
+{
+   return buffer[0] | buffer[1] << 8;
+}
+
+static bool check_header(const uint8_t *header)
+{
+   return (header[0] == 31 && header[1] == 139 && header[2] == 8 && (header[3] & 4) != 0
+         && unpackInt16(&header[10]) == 6
+         && header[12] == 'B' && header[13] == 'C'
+         && unpackInt16(&header[14]) == 2);
+}
+
+BGZFReader::BGZFReader(const string &bam_file_name, int num_inflaters):
+      _next_read(0)
+{
+   _fd = open(bam_file_name.c_str(), O_RDONLY);
+   struct stat st;
+   if (_fd < 0 || fstat(_fd, &st) != 0) {
+      cerr << "Fail to open BAM file " << bam_file_name << endl;
+      exit(1);
+   }
+   _file_size = st.st_size;
+   num_inflaters = max(1, num_inflaters);
+   _capacity = max<size_t>(8, 4 * num_inflaters);
+   _threads.emplace_back(&BGZFReader::loader, this);
+   for (int i = 0; i < num_inflaters; ++i) {
+      _threads.emplace_back(&BGZFReader::inflater, this);
+   }
+}
+
+BGZFReader::~BGZFReader()
+{
+   {
+      lock_guard<mutex> lk(_lock);
+      _stop = true;
+   }
+   _block_loaded.notify_all();
+   _block_ready.notify_all();
+   _slot_free.notify_all();
+   for (auto &t : _threads) {
+      t.join();
+   }
+   close(_fd);
+}
+
+bool BGZFReader::load_block(int64_t address, Block &b) const
+/*
+ * Read the compressed block starting at address. At the end of the file
+ * b is left empty with _next_address == address.
+ */
+{
+   b._address = address;
+   b._next_address = address;
+   b._length = 0;
+   b._comp.clear();
+   if (address >= _file_size) {
+      return true;
+   }
+   uint8_t header[kBlockHeaderLen];
+   if (pread(_fd, header, kBlockHeaderLen, address) != kBlockHeaderLen || !check_header(header)) {
+      return false;
+   }
+   int block_length = unpackInt16(&header[16]) + 1;
+   if (block_length < kBlockHeaderLen + 8) {
+      return false; // too short for the header and the CRC32/ISIZE footer
+   }
+   b._comp.resize(block_length);
+   memcpy(b._comp.data(), header, kBlockHeaderLen);
+   int remaining = block_length - kBlockHeaderLen;
+   if (pread(_fd, b._comp.data() + kBlockHeaderLen, remaining, address + kBlockHeaderLen) != remaining) {
+      return false;
+   }
+   b._next_address = address + block_length;
+   return true;
+}
+
+bool BGZFReader::inflate_block(Block &b)
+{
+   b._data.resize(BGZF_MAX_BLOCK_SIZE);
+   z_stream zs;
+   zs.zalloc = NULL;
+   zs.zfree = NULL;
+   zs.next_in = b._comp.data() + kBlockHeaderLen;
+   zs.avail_in = b._comp.size() - kBlockHeaderLen - 8; // the footer holds CRC32 and ISIZE
+   zs.next_out = b._data.data();
+   zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+   if (inflateInit2(&zs, -15) != Z_OK) {
+      return false;
+   }
+   if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+      inflateEnd(&zs);
+      return false;
+   }
+   if (inflateEnd(&zs) != Z_OK) {
+      return false;
+   }
+   b._length = zs.total_out;
+   return true;
+}
+
+void BGZFReader::loader()
+{
+   unique_lock<mutex> lk(_lock);
+   while (!_stop) {
+      uint64_t epoch = _epoch;
+      size_t ahead = count_if(_ring.begin(), _ring.end(), [this](const BlockPtr &b) {return b->_address >= _addr;});
+      if (_at_end || ahead >= _capacity) {
+         _slot_free.wait(lk);
+         continue;
+      }
+      int64_t address = _next_read;
+      BlockPtr b;
+      if (_free_blocks.empty()) {
+         b = make_shared<Block>();
+      } else {
+         b = _free_blocks.back();
+         _free_blocks.pop_back();
+      }
+      lk.unlock();
+      bool success = load_block(address, *b);
+      lk.lock();
+      if (!success) {
+         cerr << "Fail to read BGZF block at file offset " << address << endl;
+         exit(1);
+      }
+      if (epoch != _epoch) {
+         _free_blocks.push_back(b);
+         continue;
+      }
+      _next_read = b->_next_address;
+      _ring.push_back(b);
+      if (b->_comp.empty()) {
+         _at_end = true;
+         b->_state = Block::Ready;
+         _block_ready.notify_all();
+      } else {
+         b->_state = Block::Loaded;
+         _block_loaded.notify_one();
+      }
+   }
+}
+
+void BGZFReader::inflater()
+{
+   unique_lock<mutex> lk(_lock);
+   while (!_stop) {
+      auto it = find_if(_ring.begin(), _ring.end(), [](const BlockPtr &b) {return b->_state == Block::Loaded;});
+      if (it == _ring.end()) {
+         _block_loaded.wait(lk);
+         continue;
+      }
+      BlockPtr b = *it;
+      b->_state = Block::Inflating;
+      lk.unlock();
+      bool success = inflate_block(*b);
+      lk.lock();
+      if (!success) {
+         cerr << "Fail to decompress BGZF block at file offset " << b->_address << endl;
+         exit(1);
+      }
+      b->_state = Block::Ready;
+      _block_ready.notify_all();
+   }
+}
+
+BGZFReader::BlockPtr BGZFReader::acquire(unique_lock<mutex> &lk)
+/*
+ * Return the block at the consumer position, waiting for it to be inflated.
+ * If the position is outside of the read-ahead window (a far seek), the
+ * pipeline restarts from there.
+ */
+{
+   _cur.reset();
+   while (true) {
+      auto it = find_if(_ring.begin(), _ring.end(), [this](const BlockPtr &b) {return b->_address == _addr;});
+      if (it != _ring.end()) {
+         if ((*it)->_state == Block::Ready) {
+            return *it;
+         }
+         _block_ready.wait(lk);
+         continue;
+      }
+      if (_addr != _next_read || _at_end) {
+         for (auto &b : _ring) {
+            if (b->_state != Block::Inflating) _free_blocks.push_back(b);
+         }
+         _ring.clear();
+         _next_read = _addr;
+         _at_end = false;
+         ++_epoch;
+         _slot_free.notify_all();
+      }
+      _block_ready.wait(lk);
+   }
+}
+
+void BGZFReader::trim()
+{
+   while (!_ring.empty() && _ring.front()->_address < _addr) {
+      _free_blocks.push_back(_ring.front());
+      _ring.pop_front();
+   }
+   _slot_free.notify_one();
+}
+
+void BGZFReader::seek(int64_t pos)
+{
+   lock_guard<mutex> lk(_lock);
+   _addr = pos >> 16;
+   _offset = pos & 0xFFFF;
+}
+
+ssize_t BGZFReader::read(void *data, ssize_t length)
+{
+   uint8_t *output = (uint8_t*) data;
+   ssize_t bytes_read = 0;
+   while (bytes_read < length) {
+      if (!_cur || _cur->_address != _addr) {
+         unique_lock<mutex> lk(_lock);
+         _cur = acquire(lk);
+      }
+      if (_cur->_comp.empty()) { // end of file
+         break;
+      }
+      int available = _cur->_length - _offset;
+      if (available > 0) {
+         int copy_length = min<ssize_t>(length - bytes_read, available);
+         memcpy(output, _cur->_data.data() + _offset, copy_length);
+         _offset += copy_length;
+         output += copy_length;
+         bytes_read += copy_length;
+      }
+      if (_offset >= _cur->_length) {
+         lock_guard<mutex> lk(_lock);
+         _addr = _cur->_next_address;
+         _offset = 0;
+         _cur.reset();
+         trim();
+      }
+   }
+   return bytes_read;
+}
+
+int BGZFReader::read_bam1(bam1_t *b)
+/*
+ * Same as bam_read1() in samtools for little-endian hosts.
+ */
+{
+   bam1_core_t *c = &b->core;
+   int32_t block_len;
+   uint32_t x[8];
+   ssize_t ret;
+   if ((ret = read(&block_len, 4)) != 4) {
+      if (ret == 0) return -1; // normal end-of-file
+      else return -2; // truncated
+   }
+   if (read(x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+   c->tid = x[0]; c->pos = x[1];
+   c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
+   c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
+   c->l_qseq = x[4];
+   c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+   b->data_len = block_len - BAM_CORE_SIZE;
+   if (b->m_data < b->data_len) {
+      b->m_data = b->data_len;
+      kroundup32(b->m_data);
+      b->data = (uint8_t*)realloc(b->data, b->m_data);
+   }
+   if (read(b->data, b->data_len) != b->data_len) return -4;
+   b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
+   return 4 + block_len;
+}
@@ -5,13 +5,17 @@
  * **/
 
 #include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <math.h>
 #include <algorithm>
 #include <iostream>
 #include <errno.h>
 #include "common.h"
+#include <atomic>
+#include <thread>
 
-bool SINGLE_END_EXP = true;
+std::atomic<bool> SINGLE_END_EXP(true);
 bool BIAS_CORRECTION = false;
 int kMaxGeneLength = 2500000;
 int kMaxFragSpan = 1000000;
@@ -40,6 +44,8 @@ double kMinDepth4Contig = 1.0;
 int kMaxCoverGap1 = 30; // cover gap due the read depth.
 int kMaxCoverGap2 = 10;
 int kMaxReadNum4RL = 50000;
+int kMaxFragsPerLocus = 0; // 0 keeps every distinct fragment
+size_t kMaxMemory = 0; // 0 is no budget
 int num_threads = 1;
 bool NO_LOGGING = false;
 //bool singleExon4FD = false;
@@ -60,9 +66,14 @@ bool enforce_ref_models = false;
 bool utilize_ref_models = false;
 bool no_assembly = false;
 bool no_quant = false;
+bool single_pass = false;
+bool shard_by_chrom = false;
 
 std::string tracking_log = "./tracking.log";
 std::string frag_context_out = "./frag_context.csv";
+std::string hit_cache_file = "";
+std::string genome_2bit_file = "";
+std::string gtf_cache_file = "";
 bool effective_len_norm = false;
 bool use_only_unique_hits = true;
 bool fr_strand = false;
@@ -118,6 +129,19 @@ int fileExists(const char* fname)
   return r;
 }
 
+std::string fileIdentity(const std::string &fname, uint64_t &size, int64_t &mtime)
+{
+   struct stat st;
+   size = 0;
+   mtime = 0;
+   if (stat(fname.c_str(), &st) == 0) {
+      size = st.st_size;
+      mtime = st.st_mtime;
+   }
+   char resolved[PATH_MAX];
+   return realpath(fname.c_str(), resolved) != NULL ? std::string(resolved) : fname;
+}
+
 bool endsWith (std::string const &fullString, std::string const &ending)
 {
    if (fullString.length() >= ending.length()) {
@@ -563,3 +587,26 @@ FLD_source EmpDist::fld_source() const
 //      os<<".";
 //   };
 //}
+
+void run_shards(int num_shards, const std::function<void(int)> &job)
+{
+   std::atomic<int> next_shard = {0};
+   auto worker = [&] {
+      for (int tid = next_shard++; tid < num_shards; tid = next_shard++) {
+         job(tid);
+      }
+   };
+#if ENABLE_THREADS
+   if (use_threads) {
+      std::vector<std::thread> workers;
+      for (int i = 0; i < std::min(num_threads, num_shards); ++i) {
+         workers.emplace_back(worker);
+      }
+      for (auto &w : workers) {
+         w.join();
+      }
+      return;
+   }
+#endif
+   worker();
+}
@@ -3,21 +3,99 @@
 #include <dirent.h>
 #include <assert.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <string.h>
 #include <iostream>
 #include <mutex>
+#include <limits>
+#include "bgzf_reader.h"
 
 using namespace std;
-// for now this function free whole sequence and setup a
-// new _my_subseq object for FaSeqGetter. This is not an efficient way.
-void SubSeq::setup(uint s, uint l){
-    if (_sequence){ // if not empty
-       delete [] _sequence;
-    };
-   _subseq_start = s;
-   _subseq_len = l;
-   _sequence = new char[l+1];
+
+static const char k2bitMagic[8] = {'S', 'T', 'R', 'B', '2', 'B', 'I', '2'};
+static const size_t k2bitVersion = 7; // index of the format version in k2bitMagic
+
+struct TwoBitHeader {
+   char magic[8];
+   uint32_t num_seqs; // followed by num_sources TwoBitSource, then num_seqs TwoBitEntry
+   uint32_t num_sources;
+};
+
+// A fasta file the genome was built from.
+struct TwoBitSource {
+   uint32_t path_len; // followed by the canonical path, padded to 8 bytes
+   uint32_t pad;
+   uint64_t size;
+   int64_t mtime;
+};
+
+struct TwoBitEntry {
+   uint32_t name_len; // followed by the name, padded to 8 bytes
+   uint32_t seq_len;
+   uint32_t num_n_runs;
+   uint32_t pad;
+   uint64_t data_offset; // N runs as (start, length) pairs, then the packed bases
+};
+
+static inline size_t pad8(size_t n)
+{
+   return (n + 7) & ~(size_t)7;
 }
 
+static inline int base2bit(char c)
+{
+   switch (c) {
+      case 'A': case 'a': return 0;
+      case 'C': case 'c': return 1;
+      case 'G': case 'g': return 2;
+      case 'T': case 't': return 3;
+      default: return -1;
+   }
+}
+
+static const size_t kBgzfHeaderLen = 18;
+
+static bool bgzf_block_size(const char* block, size_t avail, size_t &bsize)
+/*
+ * Size of the BGZF block at block, of which avail bytes are in the file.
+ */
+{
+   const uint8_t* h = (const uint8_t*)block;
+   if(avail < kBgzfHeaderLen || h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3] & 4) == 0
+      || (h[10] | h[11] << 8) != 6 || h[12] != 'B' || h[13] != 'C' || (h[14] | h[15] << 8) != 2){
+      return false;
+   }
+   bsize = (h[16] | h[17] << 8) + 1;
+   return bsize >= kBgzfHeaderLen + 8 && bsize <= avail;
+}
+
+static bool inflate_bgzf_block(const char* block, size_t avail, string &text)
+{
+   size_t bsize;
+   if(!bgzf_block_size(block, avail, bsize)) return false;
+   uint32_t isize;
+   memcpy(&isize, block + bsize - 4, sizeof(isize));
+   text.resize(isize);
+   if(isize == 0) return true;
+   z_stream zs;
+   memset(&zs, 0, sizeof(zs));
+   zs.next_in = (Bytef*)(block + kBgzfHeaderLen);
+   zs.avail_in = bsize - kBgzfHeaderLen - 8;
+   zs.next_out = (Bytef*)&text[0];
+   zs.avail_out = isize;
+   if(inflateInit2(&zs, -15) != Z_OK) return false;
+   int ret = inflate(&zs, Z_FINISH);
+   inflateEnd(&zs);
+   return ret == Z_STREAM_END && zs.total_out == isize;
+}
 //initialize .fa file and .fai file name
 FaIndex::FaIndex(const char* fname, const char* finame){
    if(fileExists(fname) != 2) {
@@ -29,16 +107,49 @@ FaIndex::FaIndex(const char* fname, const char* finame){
       exit(1);
    }
    _fa_name.assign(fname);
+   int fd = open(fname, O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) != 0) {
+      std::cerr<<"Error: cannot open fasta file "<<fname<<std::endl;
+      exit(1);
+   }
+   _size = st.st_size;
+   void* p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      std::cerr<<"Error: cannot map fasta file "<<fname<<std::endl;
+      exit(1);
+   }
+   _data = (const char*)p;
+   size_t bsize;
+   if(bgzf_block_size(_data, _size, bsize)){
+      _gzi_name = _fa_name + ".gzi";
+      if(!loadGzi()){
+         std::cerr<<"Building bgzip index "<<_gzi_name<<std::endl;
+         _blocks.assign(1, make_pair(0, 0));
+         buildGzi();
+         writeGzi();
+      }
+   } else if(_size >= 2 && (uint8_t)_data[0] == 31 && (uint8_t)_data[1] == 139){
+      std::cerr<<"Error: fasta file "<<fname<<" is gzip compressed but not with bgzip. Recompress it with bgzip for random access."<<std::endl;
+      exit(1);
+   }
    if(finame) {
       _fai_name.assign(finame);
       if(fileExists(finame) == 2 and fileSize(finame) > 0){
          loadIndex();
       } else{
+         std::cerr<<"Building fasta index "<<_fai_name<<std::endl;
          buildIndex();
+         writeIndex();
       }
    }
 }
 
+FaIndex::~FaIndex(){
+   if (_data) munmap((void*)_data, _size);
+}
+
 int FaIndex::num_records() const { return _records.size();}
 int FaIndex::loadIndex(){
    _records.clear();
@@ -46,7 +157,6 @@ int FaIndex::loadIndex(){
    FILE* fi = fopen(_fai_name.c_str(), "rb");
    if(!fi){
       std::cerr<<"cannot open fasta index file for reading "<<_fai_name<<std::endl;
-      std::cerr<<"Currently creating fasta index is not supported. Please use samtools to build fasta index.\n";
       exit(1);
    }
    SlineReader fl(fi);
@@ -80,12 +190,292 @@ int FaIndex::loadIndex(){
       add_record(line, len ,offset, line_len, bline_len);
    }
    fclose(fi);
+   _haveFai = true;
    return _records.size();
 
 }
-// NEED to be done. Currently faIdx is generated by samtools.
+
+class FaRecordScanner{
+   /*
+    * Measure the line geometry of one fasta record, one line at a time. As
+    * in samtools faidx, every sequence line but the last must have the same
+    * length.
+    */
+   uint64_t _seq_len = 0;
+   bool _short_line = false;
+   bool _blank_line = false;
+public:
+   FaRecord _rec;
+   // line is the header line without its EoL; fpos is the offset of the first sequence line.
+   void start(const char* line, size_t len, off_t fpos){
+      size_t name_len = 0;
+      while(1 + name_len < len && !isspace(line[1 + name_len])) ++name_len;
+      _rec = FaRecord(string(line + 1, name_len), 0, fpos, 0, 0);
+      _seq_len = 0;
+      _short_line = _blank_line = false;
+   }
+   // len excludes the EoL characters, blen includes them.
+   bool add_line(size_t len, size_t blen, bool has_eol, string &err){
+      if(len == 0){
+         _blank_line = true;
+         return true;
+      }
+      if(_blank_line || _short_line || (_rec._line_len > 0 && (int)len > _rec._line_len)){
+         err = "different line length in sequence " + _rec._seq_name;
+         return false;
+      }
+      if(_rec._line_len == 0){
+         _rec._line_len = len;
+         _rec._line_blen = has_eol ? blen : len + 1;
+      } else if((int)len < _rec._line_len){
+         _short_line = true;
+      }
+      _seq_len += len;
+      return true;
+   }
+   bool finish(string &err){
+      if(_seq_len > numeric_limits<uint>::max()){
+         err = "sequence " + _rec._seq_name + " is too long";
+         return false;
+      }
+      _rec._seq_len = _seq_len;
+      return true;
+   }
+};
+
+static bool scan_fasta_record(const char* data, size_t beg, size_t end, FaRecord &rec, string &err)
+/*
+ * Fill rec with the name and line geometry of the record whose '>' is at
+ * data[beg] and which ends before data[end].
+ */
+{
+   FaRecordScanner scanner;
+   const char* nl = (const char*)memchr(data + beg, '\n', end - beg);
+   size_t name_end = nl ? nl - data : end;
+   scanner.start(data + beg, name_end - beg, nl ? name_end + 1 : end);
+   for(size_t pos = scanner._rec._fpos; pos < end; ){
+      nl = (const char*)memchr(data + pos, '\n', end - pos);
+      size_t line_end = nl ? nl - data : end;
+      size_t blen = (nl ? line_end + 1 : line_end) - pos;
+      size_t len = line_end - pos;
+      if(len > 0 && data[line_end - 1] == '\r') --len;
+      pos += blen;
+      if(!scanner.add_line(len, blen, nl != NULL, err)) return false;
+   }
+   if(!scanner.finish(err)) return false;
+   rec = scanner._rec;
+   return true;
+}
+
 int FaIndex::buildIndex(){
-   return 0;
+   if(is_bgzf()) return buildBgzfIndex();
+   /*
+    * The mapped file is cut into one chunk per thread to find the header
+    * lines; each record is then measured independently.
+    */
+   _records.clear();
+   _haveFai = false;
+   int num_chunks = max(1, num_threads);
+   size_t chunk_size = (_size + num_chunks - 1) / num_chunks;
+   vector<vector<size_t>> chunk_headers(num_chunks);
+   run_shards(num_chunks, [&](int c) {
+      size_t beg = c * chunk_size;
+      size_t end = min(_size, beg + chunk_size);
+      if(beg == 0 && _size > 0 && _data[0] == '>') chunk_headers[c].push_back(0);
+      for(size_t pos = beg; pos < end; ){
+         const char* nl = (const char*)memchr(_data + pos, '\n', end - pos);
+         if(nl == NULL) break;
+         pos = nl - _data + 1;
+         if(pos < _size && _data[pos] == '>') chunk_headers[c].push_back(pos);
+      }
+   });
+   vector<size_t> headers;
+   for(const auto &h: chunk_headers) headers.insert(headers.end(), h.begin(), h.end());
+
+   vector<FaRecord> records(headers.size());
+   vector<string> errors(headers.size());
+   vector<char> valid(headers.size());
+   run_shards(headers.size(), [&](int i) {
+      size_t end = i + 1 < (int)headers.size() ? headers[i + 1] : _size;
+      valid[i] = scan_fasta_record(_data, headers[i], end, records[i], errors[i]);
+   });
+   for(size_t i = 0; i < records.size(); ++i){
+      if(!valid[i]){
+         std::cerr<<"Error building index of "<<_fa_name<<": "<<errors[i]<<std::endl;
+         exit(1);
+      }
+      if(records[i]._seq_len == 0){
+         std::cerr<<"Warning: skip empty sequence "<<records[i]._seq_name<<" in "<<_fa_name<<std::endl;
+         continue;
+      }
+      add_record(records[i]._seq_name, records[i]._seq_len, records[i]._fpos, records[i]._line_len, records[i]._line_blen);
+   }
+   _haveFai = true;
+   return _records.size();
+}
+
+int FaIndex::buildBgzfIndex(){
+   /*
+    * Stream the uncompressed text, inflated by num_threads helper threads,
+    * and measure the records line by line; lines are never kept whole.
+    */
+   _records.clear();
+   _haveFai = false;
+   BGZFReader reader(_fa_name, num_threads);
+   vector<char> buf(1 << 20);
+   FaRecordScanner scanner;
+   bool in_record = false;
+   string err;
+   uint64_t line_start = 0, line_len = 0;
+   string header;
+   bool is_header = false;
+   char last = 0;
+   auto finish_record = [&]() {
+      if(!in_record) return;
+      if(!scanner.finish(err)){
+         std::cerr<<"Error building index of "<<_fa_name<<": "<<err<<std::endl;
+         exit(1);
+      }
+      const FaRecord &r = scanner._rec;
+      if(r._seq_len == 0){
+         std::cerr<<"Warning: skip empty sequence "<<r._seq_name<<" in "<<_fa_name<<std::endl;
+         return;
+      }
+      add_record(r._seq_name, r._seq_len, r._fpos, r._line_len, r._line_blen);
+   };
+   auto end_line = [&](bool has_eol) {
+      uint64_t blen = line_len + has_eol;
+      uint64_t len = line_len > 0 && last == '\r' ? line_len - 1 : line_len;
+      if(is_header){
+         finish_record();
+         scanner.start(header.data(), header.size(), line_start + blen);
+         in_record = true;
+      } else if(in_record && !scanner.add_line(len, blen, has_eol, err)){
+         std::cerr<<"Error building index of "<<_fa_name<<": "<<err<<std::endl;
+         exit(1);
+      }
+      line_start += blen;
+      line_len = 0;
+      is_header = false;
+      header.clear();
+   };
+   ssize_t n;
+   while((n = reader.read(buf.data(), buf.size())) > 0){
+      for(ssize_t i = 0; i < n; ){
+         const char* nl = (const char*)memchr(buf.data() + i, '\n', n - i);
+         ssize_t stop = nl ? nl - buf.data() : n;
+         if(line_len == 0 && stop > i && buf[i] == '>') is_header = true;
+         if(is_header) header.append(buf.data() + i, stop - i);
+         if(stop > i) last = buf[stop - 1];
+         line_len += stop - i;
+         i = stop;
+         if(nl){
+            end_line(true);
+            ++i;
+         }
+      }
+   }
+   if(line_len > 0) end_line(false);
+   finish_record();
+   _haveFai = true;
+   return _records.size();
+}
+
+bool FaIndex::loadGzi(){
+   /*
+    * Same layout as the .gzi of bgzip/samtools: the number of entries, then
+    * (compressed, uncompressed) offset pairs of every block but the first.
+    */
+   FILE* fi = fopen(_gzi_name.c_str(), "rb");
+   if(fi == NULL) return false;
+   uint64_t n = 0;
+   bool ok = fread(&n, sizeof(n), 1, fi) == 1;
+   _blocks.assign(1, make_pair(0, 0));
+   for(uint64_t i = 0; ok && i < n; ++i){
+      uint64_t offsets[2];
+      ok = fread(offsets, sizeof(uint64_t), 2, fi) == 2
+           && offsets[0] > _blocks.back().first && offsets[0] < _size && offsets[1] >= _blocks.back().second;
+      if(ok) _blocks.push_back(make_pair(offsets[0], offsets[1]));
+   }
+   fclose(fi);
+   if(!ok){
+      std::cerr<<"Error: invalid bgzip index "<<_gzi_name<<". Remove it to rebuild."<<std::endl;
+      exit(1);
+   }
+   // the index may stop before the last blocks, e.g. the EOF marker
+   buildGzi();
+   return true;
+}
+
+void FaIndex::buildGzi(){
+   /*
+    * Walk the block headers from the last known block to the end of the
+    * file. The uncompressed size of a block is in its footer, so nothing is
+    * inflated. The end of the file is appended last.
+    */
+   uint64_t c = _blocks.back().first, u = _blocks.back().second;
+   _blocks.pop_back();
+   while(c < _size){
+      size_t bsize;
+      if(!bgzf_block_size(_data + c, _size - c, bsize)){
+         std::cerr<<"Error: fasta file "<<_fa_name<<" has an invalid BGZF block at file offset "<<c<<std::endl;
+         exit(1);
+      }
+      uint32_t isize;
+      memcpy(&isize, _data + c + bsize - 4, sizeof(isize));
+      _blocks.push_back(make_pair(c, u));
+      c += bsize;
+      u += isize;
+   }
+   _blocks.push_back(make_pair(c, u));
+}
+
+int FaIndex::writeGzi(){
+   FILE* fo = fopen(_gzi_name.c_str(), "wb");
+   if(fo == NULL){
+      std::cerr<<"Warning: cannot write bgzip index "<<_gzi_name<<std::endl;
+      return 0;
+   }
+   uint64_t n = _blocks.size() - 2; // neither the first block nor the end of the file
+   fwrite(&n, sizeof(n), 1, fo);
+   for(uint64_t i = 1; i <= n; ++i){
+      uint64_t offsets[2] = {_blocks[i].first, _blocks[i].second};
+      fwrite(offsets, sizeof(uint64_t), 2, fo);
+   }
+   if(fclose(fo) != 0){
+      std::cerr<<"Warning: cannot write bgzip index "<<_gzi_name<<std::endl;
+      unlink(_gzi_name.c_str());
+      return 0;
+   }
+   return n;
+}
+
+int FaIndex::writeIndex(){
+   /*
+    * Same layout as samtools faidx, in the order of the fasta file. Failing
+    * to write is not fatal as the index is already in memory.
+    */
+   vector<const FaRecord*> records;
+   for(const auto &r: _records) records.push_back(&r.second);
+   sort(records.begin(), records.end(), [](const FaRecord* lhs, const FaRecord* rhs) {return lhs->_fpos < rhs->_fpos;});
+   FILE* fo = fopen(_fai_name.c_str(), "w");
+   if(fo == NULL){
+      std::cerr<<"Warning: cannot write fasta index "<<_fai_name<<std::endl;
+      return 0;
+   }
+   for(const FaRecord* r: records){
+      fprintf(fo, "%s\t%u\t%lld\t%d\t%d\n", r->_seq_name.c_str(), r->_seq_len, (long long)r->_fpos, r->_line_len, r->_line_blen);
+   }
+   if(fclose(fo) != 0){
+      std::cerr<<"Warning: cannot write fasta index "<<_fai_name<<std::endl;
+      unlink(_fai_name.c_str());
+      return 0;
+   }
+   return records.size();
+}
+
+bool FaIndex::hasIndex(){
+   return _haveFai;
 }
 
 const string FaIndex::get_faidx_name() const {return _fai_name;}
@@ -111,94 +501,158 @@ bool FaIndex::getRecord(const string &seqname, FaRecord &got) const{
    return false;
 }
 
-FaSeqGetter::~FaSeqGetter(){
-   if(_fh != nullptr) fclose(_fh);
-   _fh = nullptr;
+void FaSeqGetter::initiate(const string fname, const FaRecord &rec, const char* data, size_t size,
+                           const vector<pair<uint64_t, uint64_t>>* gz_blocks)
+{
+   _fname = fname;
+   _my_record = rec;
+   _data = data;
+   _size = size;
+   _gz_blocks = gz_blocks;
 }
 
-void FaSeqGetter::initiate(const string fname, const FaRecord &rec)
+void FaSeqGetter::initiate_packed(const string fname, const string seqname, uint seq_len,
+                                  const uint8_t* packed, const uint32_t* n_runs, uint32_t num_n_runs)
 {
    _fname = fname;
-   _my_record = rec;
-   if(_fh != nullptr){
-      fclose(_fh);
-      _fh == nullptr;
-   }
-   _fh = fopen(fname.c_str(),"rb");
+   _my_record = FaRecord(seqname, seq_len, 0, 0, 0);
+   _packed = packed;
+   _n_runs = n_runs;
+   _num_n_runs = num_n_runs;
 }
 
 string FaSeqGetter::get_fname() const {return _fname;}
 
-uint FaSeqGetter::loadSeq(uint start, uint len){
-   // get faIdx info from record
-   //start is 1-based genomic coordinate within current fasta sequence
-   int line_len = _my_record._line_len;
-   int line_blen = _my_record._line_blen;
-   int line_endlen = line_blen - line_len;
-   off_t orig_start = _my_record._fpos;
+uint64_t FaSeqGetter::text_size() const{
+   return _gz_blocks ? _gz_blocks->back().second : _size;
+}
+
+uint FaSeqGetter::loadSeq(uint start, uint len) const{
    uint seq_len = _my_record._seq_len;
    if(seq_len == 0){
       std::cerr<<"Empty or zero-length fasta record "<< _my_record._seq_name<<std::endl;
       exit(1);
    }
-   uint start_line_number = (start-1) / line_len;
-   int start_char_in_line = (start-1) % line_len;
-   off_t f_start = orig_start + (start_line_number*line_blen) + start_char_in_line;
-   uint toread = len;
-   if(toread == 0) toread = seq_len - start +1;
-   if(toread > MAX_LEN_TO_READ) toread = MAX_LEN_TO_READ;
-
-   _my_subseq.setup(start, toread);
-   //assert(start >= _my_subseq._subseq_start);
-   char* cur_char_p = _my_subseq._sequence;
-   fseeko(_fh, f_start, SEEK_SET);
-   int act_read_len = 0;
-   uint already_read_len = 0;
-   if(start_char_in_line > 0){ // read first line (partially if indeed)
-      int should_read_len = line_len - start_char_in_line;
-      if (should_read_len > toread) should_read_len = toread; // in case we need just a few chars
-      act_read_len = fread((void*)cur_char_p, 1, should_read_len, _fh);
-      if( act_read_len < should_read_len){
-         std::cerr<<"reading "<<_fname<< " encountered a premature eof. Please check input.\n";
+   if(len == 0) len = seq_len - start +1;
+   if(_packed){
+      if(start + len - 1 > seq_len){
+         std::cerr<<"reading "<<_fname<< " beyond the end of "<<_my_record._seq_name<<".\n";
          exit(1);
       }
-      toread -= act_read_len;
-      cur_char_p += act_read_len;
-      already_read_len += act_read_len;
-      fseeko(_fh, line_endlen, SEEK_CUR);
-   }
-   while(toread >= line_len){
-      act_read_len = fread((void*)cur_char_p, 1, line_len, _fh);
-      if(act_read_len < line_len){
-         cerr<<"reading "<<_fname<<" encountered a premature eof. Please check input."<<endl;
-         fclose(_fh);
-         exit(1);
-      }
-      toread -= act_read_len;
-      cur_char_p += act_read_len;
-      already_read_len += act_read_len;
-      fseeko(_fh, line_endlen, SEEK_CUR);
-   }
-   if(toread>0){ // read last line
-      act_read_len = fread((void*)cur_char_p, 1, toread, _fh);
-      if(act_read_len < toread){
-         cerr<<"reading "<<_fname<<" encountered a premature eof. Please check input."<<endl;;
-         fclose(_fh);
+      return len;
+   }
+   uint last = start + len - 2; // 0-based position of the last base
+   off_t f_last = _my_record._fpos + (off_t)(last / _my_record._line_len) * _my_record._line_blen
+                  + last % _my_record._line_len;
+   if(f_last >= (off_t)text_size()){
+      std::cerr<<"reading "<<_fname<< " encountered a premature eof. Please check input.\n";
+      exit(1);
+   }
+   return len;
+}
+
+string FaSeqGetter::fetchSeq(uint start, uint len) const{
+   /*
+    * Copy the bases straight out of the mapping, one line at a time,
+    * using the line geometry of the .fai record.
+    */
+   if(_packed) return fetchPacked(start, len);
+   const uint line_len = _my_record._line_len;
+   const uint line_blen = _my_record._line_blen;
+   uint pos = start - 1;
+   uint end = min(pos + len, _my_record._seq_len);
+   string seq;
+   seq.reserve(len);
+   while(pos < end){
+      uint col = pos % line_len;
+      uint n = min(line_len - col, end - pos);
+      off_t f_start = _my_record._fpos + (off_t)(pos / line_len) * line_blen + col;
+      if(f_start + n > (off_t)text_size()){
+         std::cerr<<"reading "<<_fname<< " encountered a premature eof. Please check input.\n";
          exit(1);
       }
-      already_read_len += act_read_len;
+      if(_gz_blocks) appendBgzf(f_start, n, seq);
+      else seq.append(_data + f_start, n);
+      pos += n;
    }
+   return seq;
+}
 
-   return already_read_len;
+void FaSeqGetter::appendBgzf(uint64_t offset, uint len, string &seq) const{
+   /*
+    * Inflate only the blocks holding [offset, offset+len) of the text. Each
+    * thread keeps the last block it inflated, as consecutive fetches mostly
+    * fall in the same block.
+    */
+   struct InflatedBlock{
+      const char* data = nullptr; // mapping the block comes from
+      size_t index = 0;
+      string text;
+   };
+   static thread_local InflatedBlock last;
+   const vector<pair<uint64_t, uint64_t>> &blocks = *_gz_blocks;
+   while(len > 0){
+      size_t i = last.index;
+      if(last.data != _data || offset < blocks[i].second || offset >= blocks[i + 1].second){
+         i = upper_bound(blocks.begin(), blocks.end(), offset,
+                         [](uint64_t off, const pair<uint64_t, uint64_t> &b) {return off < b.second;}) - blocks.begin() - 1;
+         last.data = nullptr;
+         if(!inflate_bgzf_block(_data + blocks[i].first, _size - blocks[i].first, last.text)
+            || last.text.size() != blocks[i + 1].second - blocks[i].second){
+            std::cerr<<"Fail to decompress "<<_fname<<" at file offset "<<blocks[i].first
+                     <<". If its .gzi index is stale, remove it to rebuild."<<std::endl;
+            exit(1);
+         }
+         last.data = _data;
+         last.index = i;
+      }
+      uint64_t in_block = offset - blocks[i].second;
+      uint n = min<uint64_t>(len, last.text.size() - in_block);
+      seq.append(last.text, in_block, n);
+      offset += n;
+      len -= n;
+   }
 }
 
-string FaSeqGetter::fetchSeq(uint start, uint len){
-   char str[len+1];
-   strncpy(str, _my_subseq._sequence+start-1, len);
-   str[len] = 0;
-   return string(str);
+string FaSeqGetter::fetchPacked(uint start, uint len) const{
+   /*
+    * Decode a byte (four bases) at a time through a lookup table, then
+    * overwrite the N runs that overlap the range.
+    */
+   static const vector<array<char, 4>> kDecode = [] {
+      vector<array<char, 4>> table(256);
+      const char bases[4] = {'A', 'C', 'G', 'T'};
+      for(int b = 0; b < 256; ++b){
+         for(int i = 0; i < 4; ++i) table[b][i] = bases[b >> (6 - 2 * i) & 3];
+      }
+      return table;
+   }();
+   uint pos = start - 1;
+   uint end = min(pos + len, _my_record._seq_len);
+   if(pos >= end) return string();
+   string seq(end - pos, 'N');
+   for(uint i = pos; i < end; ){
+      const array<char, 4> &four = kDecode[_packed[i >> 2]];
+      for(uint j = i & 3; j < 4 && i < end; ++j, ++i) seq[i - pos] = four[j];
+   }
+   // first run ending after pos
+   uint32_t lo = 0, hi = _num_n_runs;
+   while(lo < hi){
+      uint32_t mid = (lo + hi) / 2;
+      if(_n_runs[2 * mid] + _n_runs[2 * mid + 1] <= pos) lo = mid + 1;
+      else hi = mid;
+   }
+   for(uint32_t r = lo; r < _num_n_runs && _n_runs[2 * r] < end; ++r){
+      uint s = max(_n_runs[2 * r], pos);
+      uint e = min(_n_runs[2 * r] + _n_runs[2 * r + 1], end);
+      fill(seq.begin() + (s - pos), seq.begin() + (e - pos), 'N');
+   }
+   return seq;
 }
 
+FaInterface::~FaInterface(){
+   if (_packed_data) munmap((void*)_packed_data, _packed_size);
+}
 
 void FaInterface::initiate(const char* fpath){
    // fpath should be check non-empty in the caller
@@ -221,13 +675,14 @@ void FaInterface::initiate(const char* fpath){
             ret = _fa_indexes.insert(make_pair(fa_file_name, unique_ptr<FaIndex> (new FaIndex(fa_file_name.c_str(), fpath) ) ) );
             assert(ret.second);
          }
-      } else if(endsWith(_fa_path, ".fa") || endsWith(_fa_path, ".fasta")){
+      } else if(endsWith(_fa_path, ".fa") || endsWith(_fa_path, ".fasta")
+                || endsWith(_fa_path, ".fa.gz") || endsWith(_fa_path, ".fasta.gz")){
          string fai_name = _fa_path+".fai";
          ret = _fa_indexes.insert(make_pair(string(fpath), unique_ptr<FaIndex>(new FaIndex(fpath, fai_name.c_str()) ) )  );
          assert(ret.second);
 
       } else {
-         cerr<<"Cannot find .fasta or .fa file"<<endl;
+         cerr<<"Cannot find .fasta or .fa file (optionally bgzip compressed)"<<endl;
          exit(1);
       }
 
@@ -250,7 +705,8 @@ void FaInterface::initiate(const char* fpath){
       struct dirent *ent;
       dir = opendir(fpath);
       while((ent = readdir(dir)) != NULL){
-         if(endsWith(ent->d_name, ".fa") || endsWith(ent->d_name, ".fasta")){
+         if(endsWith(ent->d_name, ".fa") || endsWith(ent->d_name, ".fasta")
+            || endsWith(ent->d_name, ".fa.gz") || endsWith(ent->d_name, ".fasta.gz")){
             char fai_name[200];
             fai_name[0] = 0;
             strcat(fai_name, fpath);
@@ -262,51 +718,19 @@ void FaInterface::initiate(const char* fpath){
                cerr<<"file name is too long "<<fai_name<<endl;
                exit(0);
             }
-            // if index file exists
-            if( fileExists(fai_name) ==2 ) {
-               ret = _fa_indexes.insert(make_pair(fa_file_name, unique_ptr<FaIndex>(new FaIndex(fa_file_name.c_str(), fai_name) ) )  );
-               assert(ret.second);
-               // this for loop initialize _seqname_2_fafile object
-               unique_ptr<FaIndex> &faidx_ptr = ret.first->second;
-               const string &fasta_file_name  = ret.first->first;
-               for(auto record = faidx_ptr->_records.begin(); record != faidx_ptr->_records.end(); ++record){
-                  pair<unordered_map<string, string>::iterator, bool> ret_it;
-                  ret_it = _seqname_2_fafile.insert(make_pair(record->first, fasta_file_name));
-                  if(!ret_it.second){
-                     std::cerr<<"Please checking fasta file "<< fasta_file_name<<" for possible duplicated sequence names\n";
-                  }
-               }//end for loop
-            }
-            else{
-               cerr<<"Warning: fasta file "<<fa_file_name<<" lack index file!"<<endl;
-               if(!system(NULL)){
-                  cerr<<"processor is not available"<<endl;
-                  exit(0);
-               }
-               const char* samtools = "samtools faidx ";
-               char* command = (char*) malloc(1 + strlen(samtools) + fa_file_name.size());
-               strcpy(command, samtools);
-               strcat(command, fa_file_name.c_str());
-               cerr<<"Now using samtools to build fasta index file"<<endl;
-               system(command);
-
-               if(fileExists(fai_name) !=2){
-                  cerr<<"Unable to call samtools. Please check you have completely install samtools!"<<endl;
+            // FaIndex builds and writes the index if it does not exist
+            ret = _fa_indexes.insert(make_pair(fa_file_name, unique_ptr<FaIndex>(new FaIndex(fa_file_name.c_str(), fai_name) ) )  );
+            assert(ret.second);
+            // this for loop initialize _seqname_2_fafile object
+            unique_ptr<FaIndex> &faidx_ptr = ret.first->second;
+            const string &fasta_file_name  = ret.first->first;
+            for(auto record = faidx_ptr->_records.begin(); record != faidx_ptr->_records.end(); ++record){
+               pair<unordered_map<string, string>::iterator, bool> ret_it;
+               ret_it = _seqname_2_fafile.insert(make_pair(record->first, fasta_file_name));
+               if(!ret_it.second){
+                  std::cerr<<"Please checking fasta file "<< fasta_file_name<<" for possible duplicated sequence names\n";
                }
-
-               ret = _fa_indexes.insert(make_pair(fa_file_name, unique_ptr<FaIndex>(new FaIndex(fa_file_name.c_str(), fai_name) ) )  );
-               assert(ret.second);
-               // this for loop initialize _seqname_2_fafile object
-               unique_ptr<FaIndex> &faidx_ptr = ret.first->second;
-               const string &fasta_file_name  = ret.first->first;
-               for(auto record = faidx_ptr->_records.begin(); record != faidx_ptr->_records.end(); ++record){
-                  pair<unordered_map<string, string>::iterator, bool> ret_it;
-                  ret_it = _seqname_2_fafile.insert(make_pair(record->first, fasta_file_name));
-                  if(!ret_it.second){
-                     std::cerr<<"Please checking fasta file "<< fasta_file_name<<" for possible duplicated sequence names\n";
-                  }
-               }//end for loop
-            }
+            }//end for loop
          }
       }
       closedir(dir);
@@ -316,6 +740,11 @@ void FaInterface::initiate(const char* fpath){
       cerr<<"Error: not a valid file or directory "<<fpath<<endl;;
       break;
    }
+   for(const auto &seq: _seqname_2_fafile){
+      shared_ptr<FaSeqGetter> getter = make_shared<FaSeqGetter>();
+      load2FaSeqGetter(*getter, seq.first);
+      _getters.insert(make_pair(seq.first, move(getter)));
+   }
    cerr<<"Load "<<_seqname_2_fafile.size()<<" reference fasta"<<endl;
    _has_load = true;
 
@@ -332,10 +761,231 @@ void FaInterface::load2FaSeqGetter(FaSeqGetter &getter, const string seqname){
    auto it_faidx = _fa_indexes.find(fa_file_name);
    assert(it_faidx != _fa_indexes.end());
    FaRecord rec;
-   if(it_faidx->second->getRecord(seqname, rec))
-      getter.initiate(fa_file_name, rec);
+   const FaIndex &faidx = *it_faidx->second;
+   if(faidx.getRecord(seqname, rec))
+      getter.initiate(fa_file_name, rec, faidx.data(), faidx.size(), faidx.is_bgzf() ? &faidx.blocks() : nullptr);
    else{
       cerr<<"Fetching seq name "<<seqname<< " failed!"<<endl;
       exit(0);
    }
 }
+
+shared_ptr<FaSeqGetter> FaInterface::getter(const string &seqname) const{
+   auto it = _getters.find(seqname);
+   if(it == _getters.end()){
+      cerr<<"Reference sequence name "<<seqname<<" cannot be found in fasta file. Please check fasta file header line."<<endl;
+      exit(0);
+   }
+   return it->second;
+}
+
+// Sequences and source files listed at the start of a 2-bit genome.
+struct TwoBitIndex {
+   vector<pair<string, TwoBitSource>> sources;
+   vector<pair<string, TwoBitEntry>> entries;
+};
+
+// Parse the sources and entries after the header; false if the file is truncated.
+static bool parse2bitIndex(const char* data, size_t size, TwoBitIndex &index){
+   TwoBitHeader header;
+   memcpy(&header, data, sizeof(header));
+   size_t offset = sizeof(header);
+   for(uint32_t k = 0; k < header.num_sources; ++k){
+      TwoBitSource src;
+      if(offset + sizeof(src) > size) return false;
+      memcpy(&src, data + offset, sizeof(src));
+      offset += sizeof(src);
+      if(offset + src.path_len > size) return false;
+      index.sources.push_back(make_pair(string(data + offset, src.path_len), src));
+      offset += pad8(src.path_len);
+   }
+   for(uint32_t k = 0; k < header.num_seqs; ++k){
+      TwoBitEntry e;
+      if(offset + sizeof(e) > size) return false;
+      memcpy(&e, data + offset, sizeof(e));
+      offset += sizeof(e);
+      size_t data_len = e.num_n_runs * 2 * sizeof(uint32_t) + (e.seq_len + 3) / 4;
+      if(offset + e.name_len > size || e.data_offset + data_len > size) return false;
+      index.entries.push_back(make_pair(string(data + offset, e.name_len), e));
+      offset += pad8(e.name_len);
+   }
+   return true;
+}
+
+// Map a 2-bit genome read-only; NULL if it cannot be opened or has no header.
+static const char* map2bit(const string &path, size_t &size){
+   int fd = open(path.c_str(), O_RDONLY);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TwoBitHeader)){
+      if(fd >= 0) close(fd);
+      return NULL;
+   }
+   size = st.st_size;
+   void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   return p == MAP_FAILED ? NULL : (const char*)p;
+}
+
+vector<pair<string, TwoBitSource>> FaInterface::fastaSources() const{
+   vector<pair<string, TwoBitSource>> sources;
+   for(const auto &fa: _fa_indexes){
+      TwoBitSource src;
+      memset(&src, 0, sizeof(src));
+      string path = fileIdentity(fa.first, src.size, src.mtime);
+      src.path_len = path.size();
+      sources.push_back(make_pair(path, src));
+   }
+   sort(sources.begin(), sources.end(), [](const pair<string, TwoBitSource> &lhs, const pair<string, TwoBitSource> &rhs) {return lhs.first < rhs.first;});
+   return sources;
+}
+
+bool FaInterface::matches2bit(const string &path) const{
+   if(!fileExists(path.c_str())) return false;
+   size_t size = 0;
+   const char* data = map2bit(path, size);
+   if(data == NULL || memcmp(data, k2bitMagic, k2bitVersion) != 0){
+      cerr<<path<<" is not a Strawberry 2-bit genome"<<endl;
+      exit(1);
+   }
+   TwoBitIndex index;
+   bool same_version = memcmp(data, k2bitMagic, sizeof(k2bitMagic)) == 0;
+   bool complete = same_version && parse2bitIndex(data, size, index);
+   munmap((void*)data, size);
+   if(!same_version){
+      cerr<<"2-bit genome "<<path<<" was built by another version of Strawberry. Rebuilding it."<<endl;
+      return false;
+   }
+   if(!complete){
+      cerr<<"2-bit genome "<<path<<" is truncated. Rebuilding it."<<endl;
+      return false;
+   }
+   vector<pair<string, TwoBitSource>> sources = fastaSources();
+   bool same = index.sources.size() == sources.size() && index.entries.size() == _getters.size();
+   for(size_t k = 0; same && k < sources.size(); ++k){
+      same = index.sources[k].first == sources[k].first &&
+             index.sources[k].second.size == sources[k].second.size &&
+             index.sources[k].second.mtime == sources[k].second.mtime;
+   }
+   for(size_t k = 0; same && k < index.entries.size(); ++k){
+      auto it = _seqname_2_fafile.find(index.entries[k].first);
+      FaRecord rec;
+      same = it != _seqname_2_fafile.end() && _fa_indexes.at(it->second)->getRecord(it->first, rec) &&
+             rec._seq_len == index.entries[k].second.seq_len;
+   }
+   if(!same){
+      cerr<<"2-bit genome "<<path<<" was not built from the current reference fasta. Rebuilding it."<<endl;
+   }
+   return same;
+}
+
+bool FaInterface::write2bit(const string &path) const{
+   // written under a temporary name so that an interrupted run leaves no genome behind
+   string tmp_path = path + ".tmp";
+   FILE* out = fopen(tmp_path.c_str(), "wb");
+   if(out == NULL){
+      cerr<<"Cannot create 2-bit genome "<<path<<endl;
+      return false;
+   }
+   bool ok = true;
+   auto put = [&ok, out](const void* src, size_t len){
+      if(ok && len > 0 && fwrite(src, 1, len, out) != len) ok = false;
+   };
+   vector<string> names;
+   for(const auto &g: _getters) names.push_back(g.first);
+   sort(names.begin(), names.end());
+   vector<pair<string, TwoBitSource>> sources = fastaSources();
+
+   TwoBitHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, k2bitMagic, sizeof(k2bitMagic));
+   header.num_seqs = names.size();
+   header.num_sources = sources.size();
+   size_t offset = sizeof(header);
+   for(const auto &src: sources) offset += sizeof(TwoBitSource) + pad8(src.first.size());
+   for(const auto &name: names) offset += sizeof(TwoBitEntry) + pad8(name.size());
+   vector<TwoBitEntry> entries(names.size());
+   // the index is written once the data offsets are known
+   ok = fseeko(out, offset, SEEK_SET) == 0;
+
+   const uint kChunk = 1 << 20;
+   const char zeros[8] = {0};
+   for(size_t k = 0; ok && k < names.size(); ++k){
+      const FaSeqGetter &getter = *_getters.at(names[k]);
+      uint seq_len = getter.loadSeq();
+      vector<uint32_t> n_runs;
+      vector<uint8_t> packed((seq_len + 3) / 4, 0);
+      for(uint start = 0; start < seq_len; start += kChunk){
+         string chunk = getter.fetchSeq(start + 1, min(kChunk, seq_len - start));
+         for(uint i = 0; i < chunk.size(); ++i){
+            uint pos = start + i;
+            int code = base2bit(chunk[i]);
+            if(code < 0){
+               if(!n_runs.empty() && n_runs[n_runs.size() - 2] + n_runs.back() == pos) ++n_runs.back();
+               else { n_runs.push_back(pos); n_runs.push_back(1); }
+               code = 0;
+            }
+            packed[pos >> 2] |= code << (6 - 2 * (pos & 3));
+         }
+      }
+      TwoBitEntry &e = entries[k];
+      memset(&e, 0, sizeof(e));
+      e.name_len = names[k].size();
+      e.seq_len = seq_len;
+      e.num_n_runs = n_runs.size() / 2;
+      e.data_offset = offset;
+      put(n_runs.data(), n_runs.size() * sizeof(uint32_t));
+      put(packed.data(), packed.size());
+      size_t data_len = n_runs.size() * sizeof(uint32_t) + packed.size();
+      put(zeros, pad8(data_len) - data_len);
+      offset += pad8(data_len);
+   }
+
+   if(ok) ok = fseeko(out, 0, SEEK_SET) == 0;
+   put(&header, sizeof(header));
+   for(const auto &src: sources){
+      put(&src.second, sizeof(TwoBitSource));
+      put(src.first.data(), src.first.size());
+      put(zeros, pad8(src.first.size()) - src.first.size());
+   }
+   for(size_t k = 0; k < names.size(); ++k){
+      put(&entries[k], sizeof(TwoBitEntry));
+      put(names[k].data(), names[k].size());
+      put(zeros, pad8(names[k].size()) - names[k].size());
+   }
+   bool closed = fclose(out) == 0;
+   if(!ok || !closed || rename(tmp_path.c_str(), path.c_str()) != 0){
+      cerr<<"Fail to write 2-bit genome "<<path<<endl;
+      unlink(tmp_path.c_str());
+      return false;
+   }
+   return true;
+}
+
+void FaInterface::initiate2bit(const string &path){
+   _fa_path = path;
+   _packed_data = map2bit(path, _packed_size);
+   if(_packed_data == NULL){
+      cerr<<"Fail to open 2-bit genome "<<path<<endl;
+      exit(1);
+   }
+   if(memcmp(_packed_data, k2bitMagic, sizeof(k2bitMagic)) != 0){
+      cerr<<path<<" is not a Strawberry 2-bit genome"<<endl;
+      exit(1);
+   }
+   TwoBitIndex index;
+   if(!parse2bitIndex(_packed_data, _packed_size, index)){
+      cerr<<"2-bit genome "<<path<<" is truncated."<<endl;
+      exit(1);
+   }
+   for(const auto &entry: index.entries){
+      const TwoBitEntry &e = entry.second;
+      const uint32_t* n_runs = (const uint32_t*)(_packed_data + e.data_offset);
+      const uint8_t* packed = (const uint8_t*)(n_runs + 2 * e.num_n_runs);
+      shared_ptr<FaSeqGetter> getter = make_shared<FaSeqGetter>();
+      getter->initiate_packed(path, entry.first, e.seq_len, packed, n_runs, e.num_n_runs);
+      _getters.insert(make_pair(entry.first, move(getter)));
+      _seqname_2_fafile.insert(make_pair(entry.first, path));
+   }
+   cerr<<"Load "<<_seqname_2_fafile.size()<<" reference fasta"<<endl;
+   _has_load = true;
+}
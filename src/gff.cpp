@@ -1,7 +1,13 @@
 #include "gff.h"
+#include "gz_reader.h"
 #include<cstring>
 #include<cassert>
 #include<algorithm>
+#include<future>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #ifdef DEBUG
    #include<iostream>
    #include<stdio.h>
@@ -10,11 +16,11 @@
 using namespace std;
 unique_ptr<GffInfoTable> GffObj::_infotable = unique_ptr<GffInfoTable> (new GffInfoTable());
 
-void GffLine::extractAttr(const string attr, string &val) {
+void GffLine::extractAttr(const char* attr, string &val) {
    //parse a key attribute and remove it from the info string
    //(only works for attributes that have values following them after ' ' or '=')
    //static const char GTF2_ERR[]="Error parsing attribute %s ('\"' required) at GTF line:\n%s\n";
-   int attrlen=attr.length();
+   int attrlen=strlen(attr);
    char cend=attr[attrlen-1];
    //must make sure attr is not found in quoted text
    char* pos=_info;
@@ -30,7 +36,7 @@ void GffLine::extractAttr(const string attr, string &val) {
         continue;
         }
       if (!in_str && (prevch==0 || prevch==' ' || prevch == ';')
-            && stricmp(attr.c_str(),pos, attrlen)==0){ //attr match found
+            && stricmp(attr,pos, attrlen)==0){ //attr match found
 
          //check for word boundary on right
          char* epos=pos+attrlen;
@@ -79,18 +85,19 @@ void GffLine::extractAttr(const string attr, string &val) {
 }
 
 
-static char feat_type[128];
-GffLine::GffLine(const char* l)
+GffLine::GffLine(const char* l): GffLine(l, strlen(l)) {}
+
+GffLine::GffLine(const char* l, int len)
 {
-//   printf("enter in gffline constructor\n");
-   //printf("%s\n", l);
-   _llen=strlen(l);
+   // l need not be null-terminated, e.g. a line of a mapped file
+   char feat_type[128];
+   _llen=len;
    _line = new char[_llen+1];
+   memcpy(_line, l,_llen);
    _line[_llen] = 0;
-   memcpy(_line, l,_llen+1);
    _dupline =  new char[_llen+1];
+   memcpy(_dupline,l,_llen);
    _dupline[_llen] = 0;
-   memcpy(_dupline,l,_llen+1);
    _skip=false;
    _is_gff3=false;
    _info = nullptr;
@@ -122,13 +129,13 @@ GffLine::GffLine(const char* l)
    char* p=t[3];
    _start = (uint) atol(p);
    if(_start == 0){
-      std::cerr<<"invalid start coordinate at line:\n"<<l << std::endl;
+      std::cerr<<"invalid start coordinate at line:\n"<<_dupline << std::endl;
       return;
    }
    p=t[4];
    _end = (uint) atol(p);
    if (_end == 0){
-      std::cerr <<"invalid end coordinate at line:\n"<<l << std::endl;
+      std::cerr <<"invalid end coordinate at line:\n"<<_dupline << std::endl;
       return;
    }
    if (_end<_start) {
@@ -143,7 +150,7 @@ GffLine::GffLine(const char* l)
    else{
       _score = atof(p);
       if(_score == 0.0)
-         std::cerr<<"invalid feature score at line:\n"<<l << std::endl;
+         std::cerr<<"invalid feature score at line:\n"<<_dupline << std::endl;
          return;
    }
    switch(*t[6]){
@@ -330,14 +337,19 @@ GffObj::GffObj(LinePtr gl /*,GffReader & greader*/):
 }
 
 
+void GffLoci::add_mRNA(GffmRNA *gffmrna)
+{
+   _mrnas.push_back(gffmrna);
+   _mrna_index.emplace(gffmrna->_transcript_id, gffmrna);
+}
+
 GffmRNA* GffLoci::getRNA(const string rna) {
    // in mast cases, we only need to look at the last mrna in the vector.
    if(_mrnas.back()->_transcript_id == rna){
       return _mrnas.back();
    } else{
-      for(auto it = _mrnas.begin(); it != _mrnas.end(); ++it){
-         if((*it)->_transcript_id == rna) return *it;
-      }
+      auto it = _mrna_index.find(rna);
+      if(it != _mrna_index.end()) return it->second;
       std::cerr<<"Can not find the parent of mRNA "<< rna << std::endl;
    }
    return NULL;
@@ -393,58 +405,38 @@ GffLoci* GffTree::findGene(const string gene_id){
    if( _genes.back()->_gene_id == gene_id){
       return &(*_genes.back());
    } else{
-      for(auto it = _genes.begin(); it!= _genes.end(); it++){
-         if( (*it)->_gene_id == gene_id) return &(*(*it));
-      }
-      //unique_ptr<GffLoci> gene (new GffLoci(gene_id));
-      //addGene(move(gene));
-      return nullptr;
+      auto it = _gene_index.find(gene_id);
+      return it == _gene_index.end() ? nullptr : it->second;
    }
 }
 
 GffmRNA* GffTree::findmRNA(const string mrna_id, const Strand_t strand){
+   const vector<mrnaPtr> *rnas = nullptr;
+   const unordered_map<string, GffmRNA*> *index = nullptr;
    switch(strand)
    {
       case Strand_t::StrandPlus:
-      {
-         if(_forward_rnas.empty()) return nullptr;
-         if(_forward_rnas.back()->_transcript_id == mrna_id){
-            return &(*_forward_rnas.back());
-         } else {
-            for(auto it = _forward_rnas.begin(); it!= _forward_rnas.end(); it++){
-               if( (*it)->_transcript_id == mrna_id) return &(*(*it));
-            }
-         }
+         rnas = &_forward_rnas;
+         index = &_forward_index;
          break;
-      }
       case Strand_t::StrandMinus:
-      {
-         if(_reverse_rnas.empty()) return nullptr;
-         if(_reverse_rnas.back()->_transcript_id == mrna_id){
-            return &(*_reverse_rnas.back());
-         } else {
-            for(auto it = _reverse_rnas.begin(); it!= _reverse_rnas.end(); it++){
-               if( (*it)->_transcript_id == mrna_id) return &(*(*it));
-            }
-         }
+         rnas = &_reverse_rnas;
+         index = &_reverse_index;
          break;
-      }
       case Strand_t::StrandUnknown:
-      {
-         if(_unstranded_rnas.empty()) return nullptr;
-         if(_unstranded_rnas.back()->_transcript_id == mrna_id){
-            return &(*_unstranded_rnas.back());
-         } else {
-            for(auto it = _unstranded_rnas.begin(); it!= _unstranded_rnas.end(); it++){
-               if( (*it)->_transcript_id == mrna_id) return &(*(*it));
-            }
-         }
+         rnas = &_unstranded_rnas;
+         index = &_unstranded_index;
          break;
-      }
-      //default:
-         //assert(false);
+      default:
+         return nullptr;
    }
-   return nullptr;
+   if(rnas->empty()) return nullptr;
+   // the last transcript is the common case
+   if(rnas->back()->_transcript_id == mrna_id){
+      return &(*rnas->back());
+   }
+   auto it = index->find(mrna_id);
+   return it == index->end() ? nullptr : it->second;
 }
 
 GffReader::GffReader(const char* fname, FILE* stream):
@@ -469,104 +461,215 @@ bool GffReader::nextGffLine(){
    return true;
 }
 
-void GffReader::readAll(){
-   string previous_chrom;
-   GffTree* gseq = nullptr;
-   while(nextGffLine()){
-      if( _gfline->_chrom != previous_chrom){
-         previous_chrom = _gfline->_chrom;
-         unique_ptr<GffTree> g_seq(new GffTree(previous_chrom));
-         GffReader::addGseq(move(g_seq));
-         gseq = &(*_g_seqs.back());
+void GffReader::addGffLine(string &previous_chrom, GffTree* &gseq){
+   /*
+    * Add _gfline to the trees. Lines must come in file order.
+    */
+   if( _gfline->_chrom != previous_chrom){
+      previous_chrom = _gfline->_chrom;
+      unique_ptr<GffTree> g_seq(new GffTree(previous_chrom));
+      GffReader::addGseq(move(g_seq));
+      gseq = &(*_g_seqs.back());
+   }
+   switch(_gfline->_feat_type)
+   {
+   case GENE:
+    {
+      unique_ptr<GffLoci> gene (new GffLoci(_gfline));
+       //SError("first seq id: %d \n", gene->get_seq_id());
+      gseq->addGene(move(gene));
+      break;
+    }
+   case mRNA:
+    {
+
+      GffLoci* gene = gseq->findGene(_gfline->parent());
+      if (gene == nullptr) break;
+
+      unique_ptr<GffmRNA> mrna( new GffmRNA(_gfline, gene));
+      GffmRNA *cur_mrna = NULL;
+      if(mrna->strand() == Strand_t::StrandPlus){
+         gseq->addPlusRNA(move(mrna));
+         cur_mrna = gseq->last_f_rna();
+      } else if(mrna->strand() == Strand_t::StrandMinus){
+         gseq->addMinusRNA(move(mrna));
+         cur_mrna = gseq->last_r_rna();
+      } else if(mrna->strand() == Strand_t::StrandUnknown){
+         gseq->addUnstrandedRNA(move(mrna));
+         cur_mrna = gseq->last_u_rna();
       }
-      switch(_gfline->_feat_type)
-      {
-      case GENE:
-       {
-         unique_ptr<GffLoci> gene (new GffLoci(_gfline));
-          //SError("first seq id: %d \n", gene->get_seq_id());
-         gseq->addGene(move(gene));
-         break;
-       }
-      case mRNA:
-       {
-
-         GffLoci* gene = gseq->findGene(_gfline->parent());
-         if (gene == nullptr) break;
-
-         unique_ptr<GffmRNA> mrna( new GffmRNA(_gfline, gene));
-         GffmRNA *cur_mrna = NULL;
-         if(mrna->strand() == Strand_t::StrandPlus){
-            gseq->addPlusRNA(move(mrna));
-            cur_mrna = gseq->last_f_rna();
-         } else if(mrna->strand() == Strand_t::StrandMinus){
-            gseq->addMinusRNA(move(mrna));
-            cur_mrna = gseq->last_r_rna();
-         } else if(mrna->strand() == Strand_t::StrandUnknown){
-            gseq->addUnstrandedRNA(move(mrna));
-            cur_mrna = gseq->last_u_rna();
-         }
-         else{
-            assert(false);
-         }
-         // mrna now is released
-         // it is most possible that the last gene is the parent.
-         gene->add_mRNA(cur_mrna);
-         break;
+      else{
+         assert(false);
+      }
+      // mrna now is released
+      // it is most possible that the last gene is the parent.
+      gene->add_mRNA(cur_mrna);
+      break;
+    }
+   case EXON:
+    {
+       string parent = _gfline->parent();
+       if (parent.empty()) { // gtf format
+          parent = _gfline->_transcript_id;
+          //cerr<<parent<<" parent\n";
+          //cerr<<_gfline->_gene_id<<" gene id\n";
        }
-      case EXON:
-       {
-          string parent = _gfline->parent();
-          if (parent.empty()) { // gtf format
-             parent = _gfline->_transcript_id;
-             //cerr<<parent<<" parent\n";
-             //cerr<<_gfline->_gene_id<<" gene id\n";
+       assert(!parent.empty());
+       GffmRNA* mrna = gseq->findmRNA(parent, _gfline->_strand);
+       GffLoci* gene = nullptr;
+       if (mrna == nullptr) {
+          gene = gseq->findGene(_gfline->_gene_id);
+          if (gene == nullptr) {
+            unique_ptr<GffLoci> locus(new GffLoci(_gfline->_gene_id));
+            gseq->addGene(move(locus));
+            gene = gseq->findGene(_gfline->_gene_id);
+            assert(gene != nullptr);
           }
-          assert(!parent.empty());
-          GffmRNA* mrna = gseq->findmRNA(parent, _gfline->_strand);
-          GffLoci* gene = nullptr;
-          if (mrna == nullptr) {
-             gene = gseq->findGene(_gfline->_gene_id);
-             if (gene == nullptr) {
-               unique_ptr<GffLoci> locus(new GffLoci(_gfline->_gene_id));
-               gseq->addGene(move(locus));
-               gene = gseq->findGene(_gfline->_gene_id);
-               assert(gene != nullptr);
-             }
-             mrnaPtr transcript(new GffmRNA(_gfline, gene));
-             if(transcript->strand() == Strand_t::StrandPlus){
-                gseq->addPlusRNA(move(transcript));
-                mrna = gseq->last_f_rna();
-             } else if(transcript->strand() == Strand_t::StrandMinus){
-                gseq->addMinusRNA(move(transcript));
-                mrna = gseq->last_r_rna();
-             } else if(transcript->strand() == Strand_t::StrandUnknown){
-                gseq->addUnstrandedRNA(move(transcript));
-                mrna = gseq->last_u_rna();
-             }
-
-          } else {
-             gene = mrna->getParentGene();
+          mrnaPtr transcript(new GffmRNA(_gfline, gene));
+          if(transcript->strand() == Strand_t::StrandPlus){
+             gseq->addPlusRNA(move(transcript));
+             mrna = gseq->last_f_rna();
+          } else if(transcript->strand() == Strand_t::StrandMinus){
+             gseq->addMinusRNA(move(transcript));
+             mrna = gseq->last_r_rna();
+          } else if(transcript->strand() == Strand_t::StrandUnknown){
+             gseq->addUnstrandedRNA(move(transcript));
+             mrna = gseq->last_u_rna();
           }
-          //cerr<<mrna->_transcript_id<<" transcript id"<<endl;
-          exonPtr exon(new GffExon(_gfline, mrna, gene));
-          assert(exon->_iv.left());
-          gene->add_exon(move(exon), mrna);
-          //GffExon exon(_gfline, _g_seqs[cur_gseq]->last_gene(), *this);
-          //GffExon *cur_exon = NULL;
+
+       } else {
+          gene = mrna->getParentGene();
        }
-      default:
-         break;
+       //cerr<<mrna->_transcript_id<<" transcript id"<<endl;
+       exonPtr exon(new GffExon(_gfline, mrna, gene));
+       assert(exon->_iv.left());
+       gene->add_exon(move(exon), mrna);
+       //GffExon exon(_gfline, _g_seqs[cur_gseq]->last_gene(), *this);
+       //GffExon *cur_exon = NULL;
+    }
+   default:
+      break;
+   }
+}
+
+static void parse_gff_lines(const char* data, size_t beg, size_t end, vector<LinePtr> &lines)
+/*
+ * Parse the lines in data[beg, end) that nextGffLine() would return.
+ */
+{
+   while(beg < end){
+      const char* nl = (const char*)memchr(data + beg, '\n', end - beg);
+      size_t line_end = nl ? nl - data : end;
+      const char* l = data + beg;
+      int len = line_end - beg;
+      if(len > 0 && l[len - 1] == '\r') --len;
+      beg = nl ? line_end + 1 : end;
+      int ns=0; // first nonspace position
+      while (ns < len && isspace(l[ns])) ns++;
+      if((ns < len && l[ns]=='#') || len<10) continue;
+      LinePtr gl(new GffLine(l, len));
+      if(gl->_skip) continue;
+      lines.push_back(move(gl));
+   }
+}
+
+static size_t next_line_start(const char* data, size_t size, size_t pos)
+{
+   if(pos >= size) return size;
+   const char* nl = (const char*)memchr(data + pos, '\n', size - pos);
+   return nl ? nl - data + 1 : size;
+}
+
+void GffReader::readAll(){
+   /*
+    * The annotation is parsed in blocks of whole lines, taken from the mapped
+    * file or from a gzip stream inflated on a helper thread. The lines of a
+    * block are tokenized in line-aligned chunks on num_threads threads while
+    * the previous block is added to the trees, which has to be done in file
+    * order.
+    */
+   string previous_chrom;
+   GffTree* gseq = nullptr;
+   const int num_chunks = max(1, num_threads);
+   const size_t kChunkSize = 1 << 22;
+   using Block = pair<const char*, size_t>;
+   using Window = vector<vector<LinePtr>>;
+
+   function<bool(Block&, shared_ptr<string>&)> next_block;
+   unique_ptr<GzBlockReader> gz_reader;
+   const char* data = nullptr;
+   size_t size = 0;
+   size_t offset = 0;
+   if(endsWith(_fname, ".gz")){
+      gz_reader.reset(new GzBlockReader(_fname, num_chunks * kChunkSize));
+      next_block = [&](Block &block, shared_ptr<string> &owner) {
+         owner = make_shared<string>();
+         if(!gz_reader->next(*owner)) return false;
+         block = Block(owner->data(), owner->size());
+         return true;
+      };
+   } else {
+      int fd = open(_fname.c_str(), O_RDONLY);
+      struct stat st;
+      if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0){
+         if(fd >= 0) close(fd);
+         while(nextGffLine()){
+            addGffLine(previous_chrom, gseq);
+         }
+         return;
       }
+      size = st.st_size;
+      void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(p == MAP_FAILED){
+         std::cerr<<"Error: cannot map annotation file "<<_fname<<std::endl;
+         exit(1);
+      }
+      data = (const char*)p;
+      madvise(p, size, MADV_SEQUENTIAL);
+      next_block = [&](Block &block, shared_ptr<string> &owner) {
+         if(offset >= size) return false;
+         size_t end = next_line_start(data, size, offset + num_chunks * kChunkSize - 1);
+         block = Block(data + offset, end - offset);
+         offset = end;
+         return true;
+      };
    }
-//#ifdef DEBUG
-//   cout<< gseq->_genes[0]->_non_dup_exons.size()<<endl;
-//   for(auto &i: gseq->_reverse_rnas[1]->_exons){
-//      cout<< i->_iv.left()<<endl;
-//   }
-//#endif
-   gseq = nullptr;
 
+   // owner keeps a decompressed block alive until it is parsed
+   auto parse_block = [num_chunks](Block block, shared_ptr<string> owner) {
+      Window chunks(num_chunks);
+      vector<size_t> bounds(num_chunks + 1, 0);
+      for(int c = 1; c <= num_chunks; ++c){
+         bounds[c] = c == num_chunks ? block.second :
+               next_line_start(block.first, block.second, max(bounds[c - 1], block.second * c / num_chunks));
+      }
+      run_shards(num_chunks, [&](int c) {
+         parse_gff_lines(block.first, bounds[c], bounds[c + 1], chunks[c]);
+      });
+      return chunks;
+   };
+   Block block;
+   shared_ptr<string> owner;
+   future<Window> next;
+   if(next_block(block, owner)){
+      next = async(launch::async, parse_block, block, owner);
+   }
+   while(next.valid()){
+      Window window = next.get();
+      if(next_block(block, owner)){
+         next = async(launch::async, parse_block, block, owner);
+      }
+      owner.reset();
+      for(auto &chunk : window){
+         for(auto &line : chunk){
+            _gfline = move(line);
+            addGffLine(previous_chrom, gseq);
+         }
+      }
+   }
+   _gfline.reset();
+   if(data) munmap((void*)data, size);
 }
 
 void GffReader::sortExonOrderInMinusStrand(){
@@ -580,3 +683,43 @@ void GffReader::sortExonOrderInMinusStrand(){
       }
    }
 }
+
+vector<AnnotatedSeq> GffReader::annotatedSeqs() const{
+   /*
+    * Reduce each GffTree to its transcripts with exons, plus strand first,
+    * then minus strand, then unstranded, and sort them by intron chain.
+    */
+   vector<AnnotatedSeq> result;
+   for(const auto &gseq : _g_seqs){
+      AnnotatedSeq seq;
+      seq._name = gseq->_g_seq_name;
+      seq._gff_seq_id = gseq->get_gseq_id();
+      const vector<mrnaPtr> *rnas[3] = {&gseq->_forward_rnas, &gseq->_reverse_rnas, &gseq->_unstranded_rnas};
+      const Strand_t strands[3] = {Strand_t::StrandPlus, Strand_t::StrandMinus, Strand_t::StrandUnknown};
+      for(int k = 0; k < 3; ++k){
+         for(const auto &mrna : *rnas[k]){
+            if(mrna->_exons.size() == 0){
+               continue;
+            }
+            RefTranscript transcript;
+            transcript._strand = strands[k];
+            for(uint e = 0; e < mrna->_exons.size(); ++e){
+               GffExon& ex = *(mrna->_exons[e]);
+               transcript._feats.push_back(GenomicFeature(Match_t::S_MATCH, ex._iv.left(), ex._iv.right()-ex._iv.left()+1));
+               if( e + 1 < mrna->_exons.size()){
+                  GffExon& next_ex  = *(mrna->_exons[e+1]);
+                  transcript._feats.push_back(GenomicFeature(Match_t::S_INTRON, ex._iv.right()+1, next_ex._iv.left()-1-ex._iv.right() ));
+               }
+            }
+            transcript._transcript_id = mrna->_transcript_id;
+            transcript._gene_id = mrna->getParentGene()->_gene_id;
+            transcript._gene_name = mrna->getParentGene()->_gene_name;
+            seq._transcripts.push_back(move(transcript));
+         }
+      }
+      sort(seq._transcripts.begin(), seq._transcripts.end(),
+           [](const RefTranscript &lhs, const RefTranscript &rhs){return lhs._feats < rhs._feats;});
+      result.push_back(move(seq));
+   }
+   return result;
+}
@@ -0,0 +1,80 @@
+/*
+ * gz_reader.cpp
+ *
+ * See gz_reader.h.
+ */
+
+#include "gz_reader.h"
+#include <iostream>
+
+using namespace std;
+
+GzBlockReader::GzBlockReader(const string &file_name, size_t block_size):
+      _file_name(file_name),
+      _block_size(block_size)
+{
+   _fp = gzopen(file_name.c_str(), "rb");
+   if (_fp == NULL) {
+      cerr << "Fail to open gzip file " << file_name << endl;
+      exit(1);
+   }
+   gzbuffer(_fp, 1 << 20);
+   _thread = thread(&GzBlockReader::inflater, this);
+}
+
+GzBlockReader::~GzBlockReader()
+{
+   {
+      lock_guard<mutex> lk(_lock);
+      _stop = true;
+   }
+   _slot_free.notify_all();
+   _thread.join();
+   gzclose(_fp);
+}
+
+void GzBlockReader::inflater()
+{
+   string carry; // partial last line of the previous block
+   while (true) {
+      string block;
+      block.swap(carry);
+      size_t kept = block.size();
+      block.resize(kept + _block_size);
+      int n = gzread(_fp, &block[kept], _block_size);
+      if (n < 0) {
+         int errnum;
+         cerr << "Fail to decompress " << _file_name << ": " << gzerror(_fp, &errnum) << endl;
+         exit(1);
+      }
+      block.resize(kept + n);
+      bool at_end = n == 0;
+      if (!at_end) {
+         size_t last_eol = block.rfind('\n');
+         if (last_eol == string::npos) { // a line longer than a block
+            carry.swap(block);
+            continue;
+         }
+         carry.assign(block, last_eol + 1, string::npos);
+         block.resize(last_eol + 1);
+      }
+      unique_lock<mutex> lk(_lock);
+      _slot_free.wait(lk, [this] {return _stop || _blocks.size() < _capacity;});
+      if (_stop) return;
+      if (!block.empty()) _blocks.push_back(move(block));
+      if (at_end) _done = true;
+      _block_ready.notify_one();
+      if (at_end) return;
+   }
+}
+
+bool GzBlockReader::next(string &block)
+{
+   unique_lock<mutex> lk(_lock);
+   _block_ready.wait(lk, [this] {return _done || !_blocks.empty();});
+   if (_blocks.empty()) return false;
+   block = move(_blocks.front());
+   _blocks.pop_front();
+   _slot_free.notify_one();
+   return true;
+}
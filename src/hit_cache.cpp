@@ -0,0 +1,317 @@
+/*
+ * hit_cache.cpp
+ *
+ * See hit_cache.h.
+ */
+
+#include "hit_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace std;
+
+static const char kCacheMagic[8] = {'S', 'T', 'R', 'B', 'H', 'I', 'T', '3'};
+static const size_t kMagicVersion = 7; // index of the format version in kCacheMagic
+
+/*
+ * Read filters applied before hits are cached and the library type the cached
+ * strands were derived with; a cache can only be reused with the same values.
+ */
+struct CacheHeader {
+   char magic[8];
+   int32_t min_intron_len;
+   int32_t max_intron_len;
+   uint8_t unique_hits_only;
+   uint8_t fr_strand;
+   uint8_t rf_strand;
+   uint8_t pad;
+   uint32_t num_refs; // followed by num_refs (uint32 length, name) pairs
+   uint32_t num_sources; // then num_sources (uint32 length, path) pairs, each followed by a SourceRecord
+   uint32_t pad2;
+};
+
+// Size and modification time of a BAM file the cache was built from.
+struct SourceRecord {
+   uint64_t size;
+   int64_t mtime;
+};
+
+/*
+ * The canonical path of bam_file with its size and modification time.
+ * Standard input has neither, so a cache built from it is only read by the
+ * run that wrote it.
+ */
+static string source_stat(const string &bam_file, SourceRecord &r)
+{
+   memset(&r, 0, sizeof(r));
+   if (bam_file == "-") return bam_file;
+   return fileIdentity(bam_file, r.size, r.mtime);
+}
+
+struct HitRecord {
+   uint64_t read_id;
+   int32_t ref_id;
+   uint32_t left;
+   uint32_t right;
+   int32_t partner_ref_id;
+   uint32_t partner_pos;
+   uint32_t sam_flag;
+   int32_t num_hits;
+   int16_t num_mismatch;
+   uint8_t strand;
+   uint8_t pad;
+   uint32_t n_cigar; // followed by n_cigar (length << 4 | op) words
+};
+
+static CacheHeader current_header()
+{
+   CacheHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+   h.min_intron_len = kMinIntronLength;
+   h.max_intron_len = kMaxIntronLength;
+   h.unique_hits_only = use_only_unique_hits;
+   h.fr_strand = fr_strand;
+   h.rf_strand = rf_strand;
+   return h;
+}
+
+bool CachedHitFactory::write(HitFactory& source, const vector<string>& bam_files,
+                             const string& cache_file_name)
+{
+   FILE* out = fopen(cache_file_name.c_str(), "wb");
+   if (out == NULL) {
+      cerr << "Cannot create hit cache " << cache_file_name << endl;
+      return false;
+   }
+   CacheHeader header = current_header();
+   const RefSeqTable& ref_t = source._ref_table;
+   header.num_refs = ref_t.size();
+   header.num_sources = bam_files.size();
+   fwrite(&header, sizeof(header), 1, out);
+   for (int i = 0; i < ref_t.size(); ++i) {
+      string name = ref_t.ref_real_name(i);
+      uint32_t len = name.size();
+      fwrite(&len, sizeof(len), 1, out);
+      fwrite(name.data(), 1, len, out);
+   }
+   for (const auto &bam_file : bam_files) {
+      SourceRecord r;
+      string path = source_stat(bam_file, r);
+      uint32_t len = path.size();
+      fwrite(&len, sizeof(len), 1, out);
+      fwrite(path.data(), 1, len, out);
+      fwrite(&r, sizeof(r), 1, out);
+   }
+
+   const char* buf = NULL;
+   size_t buf_size = 0;
+   vector<uint32_t> ops;
+   while (source.nextRecord(buf, buf_size)) {
+      ReadHit hit;
+      if (!source.getHitFromBuf(buf, hit) || hit.ref_id() == -1) continue;
+      HitRecord r;
+      memset(&r, 0, sizeof(r));
+      r.read_id = hit.read_id();
+      r.ref_id = hit.ref_id();
+      r.left = hit.left();
+      r.right = hit.right();
+      r.partner_ref_id = hit.partner_ref_id();
+      r.partner_pos = hit.partner_pos();
+      r.sam_flag = hit.sam_flag();
+      r.num_hits = hit.numHits();
+      r.num_mismatch = hit.num_mismatch();
+      r.strand = static_cast<uint8_t>(hit.strand());
+      r.n_cigar = hit.cigar().size();
+      ops.clear();
+      for (const auto& op : hit.cigar()) {
+         ops.push_back((uint32_t)op._length << 4 | op._type);
+      }
+      fwrite(&r, sizeof(r), 1, out);
+      fwrite(ops.data(), sizeof(uint32_t), ops.size(), out);
+   }
+   if (fclose(out) != 0) {
+      cerr << "Fail to write hit cache " << cache_file_name << endl;
+      return false;
+   }
+   return true;
+}
+
+CachedHitFactory::CachedHitFactory(const string& cache_file_name,
+                                   const vector<string>& bam_files,
+                                   ReadTable& read_table,
+                                   RefSeqTable& ref_table):
+                  HitFactory(read_table, ref_table, bam_files.front()),
+                  _cache_file_name(cache_file_name),
+                  _bam_files(bam_files)
+{
+   int fd = open(cache_file_name.c_str(), O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+      cerr << "Fail to open hit cache " << cache_file_name << endl;
+      exit(1);
+   }
+   _size = st.st_size;
+   void* p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      cerr << "Fail to map hit cache " << cache_file_name << endl;
+      exit(1);
+   }
+   _data = (const char*)p;
+   madvise(p, _size, MADV_SEQUENTIAL);
+}
+
+CachedHitFactory::~CachedHitFactory()
+{
+   if (_data) munmap((void*)_data, _size);
+}
+
+bool CachedHitFactory::inspect_header()
+{
+   CacheHeader header;
+   memcpy(&header, _data, sizeof(header));
+   if (memcmp(header.magic, kCacheMagic, kMagicVersion) != 0) {
+      cerr << _cache_file_name << " is not a Strawberry hit cache" << endl;
+      exit(1);
+   }
+   if (header.magic[kMagicVersion] != kCacheMagic[kMagicVersion]) {
+      cerr << "Hit cache " << _cache_file_name << " was built by another version of Strawberry."
+           << " Remove it to rebuild." << endl;
+      exit(1);
+   }
+   CacheHeader expected = current_header();
+   if (header.min_intron_len != expected.min_intron_len ||
+       header.max_intron_len != expected.max_intron_len ||
+       header.unique_hits_only != expected.unique_hits_only ||
+       header.fr_strand != expected.fr_strand || header.rf_strand != expected.rf_strand) {
+      cerr << "Hit cache " << _cache_file_name << " was built with different -j/-J/--allow-multimapped-hits/--fr/--rf settings."
+           << " Remove it to rebuild." << endl;
+      exit(1);
+   }
+   size_t offset = sizeof(header);
+   bool truncated = false;
+   auto next_string = [&](string &str) {
+      uint32_t len;
+      truncated = truncated || offset + sizeof(len) > _size;
+      if (truncated) return;
+      memcpy(&len, _data + offset, sizeof(len));
+      offset += sizeof(len);
+      truncated = offset + len > _size;
+      if (truncated) return;
+      str.assign(_data + offset, len);
+      offset += len;
+   };
+   vector<string> ref_names(header.num_refs);
+   for (auto &name : ref_names) next_string(name);
+   bool same_sources = header.num_sources == _bam_files.size();
+   for (uint32_t i = 0; i < header.num_sources && !truncated; ++i) {
+      string path;
+      SourceRecord r, expected;
+      next_string(path);
+      truncated = truncated || offset + sizeof(r) > _size;
+      if (truncated) break;
+      memcpy(&r, _data + offset, sizeof(r));
+      offset += sizeof(r);
+      same_sources = same_sources && path == source_stat(_bam_files[i], expected) &&
+                     r.size == expected.size && r.mtime == expected.mtime;
+   }
+   if (truncated) {
+      cerr << "Hit cache " << _cache_file_name << " is truncated." << endl;
+      exit(1);
+   }
+   if (!same_sources) {
+      cerr << "Hit cache " << _cache_file_name << " was not built from the current BAM file(s)."
+           << " Remove it to rebuild." << endl;
+      exit(1);
+   }
+   for (uint32_t i = 0; i < ref_names.size(); ++i) {
+      RefID id = _ref_table.set_id(ref_names[i]);
+      if (id != (RefID)i) {
+         cerr << "Sort order of reads in BAM not consistent." << endl;
+         exit(0);
+      }
+   }
+   _first_record = offset;
+   _offset = offset;
+   return true;
+}
+
+bool CachedHitFactory::recordsRemain() const
+{
+   return !_eof_encountered || !_lookahead.empty();
+}
+
+void CachedHitFactory::reset()
+{
+   _lookahead.clear();
+   _offset = _first_record;
+   _eof_encountered = false;
+}
+
+int64_t CachedHitFactory::getCurrPos()
+{
+   return _offset;
+}
+
+void CachedHitFactory::return2Pos(int64_t pos)
+{
+   _lookahead.clear();
+   _offset = pos;
+   _eof_encountered = false;
+}
+
+bool CachedHitFactory::nextRecord(const char* &buf, size_t& buf_size)
+{
+   if (_eof_encountered) return false;
+   if (_offset + sizeof(HitRecord) > _size) {
+      _eof_encountered = true;
+      return false;
+   }
+   uint32_t n_cigar;
+   memcpy(&n_cigar, _data + _offset + offsetof(HitRecord, n_cigar), sizeof(n_cigar));
+   size_t record_size = sizeof(HitRecord) + n_cigar * sizeof(uint32_t);
+   if (_offset + record_size > _size) {
+      cerr << "Hit cache " << _cache_file_name << " is truncated." << endl;
+      _eof_encountered = true;
+      return false;
+   }
+   buf = _data + _offset;
+   buf_size = record_size;
+   _offset += record_size;
+   return true;
+}
+
+bool CachedHitFactory::getHitFromBuf(const char* bwt_buf, ReadHit& bh)
+{
+   HitRecord r;
+   memcpy(&r, bwt_buf, sizeof(r));
+   vector<CigarOp> cigar;
+   cigar.reserve(r.n_cigar);
+   for (uint32_t i = 0; i < r.n_cigar; ++i) {
+      uint32_t op;
+      memcpy(&op, bwt_buf + sizeof(r) + i * sizeof(op), sizeof(op));
+      cigar.push_back(CigarOp((CigarOpCode)(op & 0xf), op >> 4));
+   }
+   if (r.sam_flag & BAM_FPAIRED) {
+      SINGLE_END_EXP = false;
+   }
+   bh = ReadHit(r.read_id,
+                "",
+                GenomicInterval(r.ref_id, r.left, r.right, static_cast<Strand_t>(r.strand)),
+                cigar,
+                r.partner_ref_id,
+                r.partner_pos,
+                r.num_mismatch,
+                r.num_hits,
+                r.sam_flag,
+                1.0,
+                NULL,
+                0);
+   return true;
+}
@@ -6,6 +6,7 @@
 //#include <typeinfo>
 #include<cxxabi.h>
 #include<numeric>
+#include <array>
 #include <sam/bam.h>
 #include "read.hpp"
 //#include "kmer.h"
@@ -31,7 +32,8 @@ ReadHit::ReadHit(
    int numHit,
    uint32_t samFlag,
    double mass,
-   char* seq):
+   const uint8_t* packed_seq,
+   uint seq_len):
       _read_id(readID),
       _read_name(readname),
       _iv(iv),
@@ -40,10 +42,11 @@ ReadHit::ReadHit(
       _partner_pos(partnerPos),
       _num_mismatch(numMismatch),
       _num_hits(numHit),
-      _sam_flag(samFlag)
+      _sam_flag(samFlag),
+      _seq_len(seq_len)
 {
-   if(seq != NULL){
-      _seq = string(seq);
+   if(packed_seq != NULL){
+      _packed_seq.assign(packed_seq, packed_seq + (seq_len + 1) / 2);
    }
 
    if(is_singleton()){
@@ -53,6 +56,30 @@ ReadHit::ReadHit(
    }
 }
 
+string ReadHit::seq() const
+/*
+ * Decode the packed sequence one byte (two bases) at a time.
+ */
+{
+   static const auto pair_table = [] {
+      array<array<char, 2>, 256> t;
+      for (int b = 0; b < 256; ++b) {
+         t[b][0] = bam_nt16_rev_table[b >> 4];
+         t[b][1] = bam_nt16_rev_table[b & 0xf];
+      }
+      return t;
+   }();
+   string s(_seq_len, 'N');
+   uint full = _seq_len / 2;
+   for (uint i = 0; i < full; ++i) {
+      memcpy(&s[2 * i], pair_table[_packed_seq[i]].data(), 2);
+   }
+   if (_seq_len & 1) {
+      s[_seq_len - 1] = pair_table[_packed_seq[full]][0];
+   }
+   return s;
+}
+
 const vector<CigarOp>& ReadHit::cigar() const
 {
    return _cigar;
@@ -166,6 +193,7 @@ uint ReadHit::left() const { return _iv.left();}
 
 int ReadHit::numHits() const { return _num_hits;}
 int ReadHit::num_mismatch() const { return _num_mismatch;}
+uint32_t ReadHit::sam_flag() const { return _sam_flag;}
 
 bool ReadHit::is_singleton() const
 {
@@ -375,13 +403,68 @@ BAMHitFactory::BAMHitFactory(const string& bam_file_name,
    }
 
    _beginning = bgzf_tell(_hit_file->x.bam);
-   _curr_pos = _beginning;
    _eof_encountered = false;
+#if ENABLE_THREADS
+   if (use_threads && !bam_is_be && seekable()) {
+      _reader = unique_ptr<BGZFReader>(new BGZFReader(bam_file_name, num_threads));
+      _reader->seek(_beginning);
+   }
+#endif
 
 }
 
+BAMHitFactory::BAMHitFactory(const BAMHitFactory& whole_file,
+                             ReadTable &read_table,
+                             int tid):
+                 HitFactory(read_table, whole_file._ref_table, whole_file._hit_file_name),
+                 _index(whole_file._index),
+                 _tid(tid),
+                 _tid2ref(whole_file._tid2ref)
+/*
+ * Factory restricted to reference sequence tid of a coordinate sorted and
+ * indexed BAM file. The index is owned by whole_file, which has to outlive
+ * this object. The reference table is shared read-only.
+ */
+{
+   assert(_index != NULL);
+   _hit_file = samopen(_hit_file_name.c_str(), "rb", 0);
+   memset(&_next_hit, 0, sizeof(_next_hit));
+   if(_hit_file == NULL || _hit_file->header == NULL){
+      cerr<<"Fail to open BAM file..."<<endl;
+      exit(0);
+   }
+   _beginning = bgzf_tell(_hit_file->x.bam);
+   _eof_encountered = false;
+   set_region(_tid, 0, 1<<29);
+}
+
+void BAMHitFactory::set_region(int tid, int beg, int end)
+/*
+ * Restrict a region factory to the records overlapping [beg, end) of tid.
+ */
+{
+   assert(tid >= 0 && _tid >= 0); // region mode only
+   if (_iter) bam_iter_destroy(_iter);
+   _tid = tid;
+   _beg = beg;
+   _end = end;
+   _iter = bam_iter_query(_index, _tid, _beg, _end);
+   _lookahead.clear();
+   _eof_encountered = false;
+}
+
+bool BAMHitFactory::load_index()
+{
+   if (_index == NULL) {
+      _index = bam_index_load(_hit_file_name.c_str());
+   }
+   return _index != NULL;
+}
+
 BAMHitFactory::~BAMHitFactory()
 {
+   if (_iter) bam_iter_destroy(_iter);
+   if (_index && _tid < 0) bam_index_destroy(_index);
    if (_hit_file){
       samclose(_hit_file);
       free(_next_hit.data);
@@ -419,6 +502,11 @@ bool BAMHitFactory::inspect_header()
       free(h_text);
    }
 
+   _tid2ref.resize(header->n_targets);
+   for (int tid = 0; tid < header->n_targets; ++tid) {
+      _tid2ref[tid] = _ref_table.get_id(header->target_name[tid]);
+   }
+
 //   for (auto & id : _ref_table._name2id) {
 //      cout<<"id, name"<<id.first<<","<<id.second<<endl;
 //   }
@@ -427,33 +515,39 @@ bool BAMHitFactory::inspect_header()
 
 void BAMHitFactory::reset()
 {
-   if (_hit_file && _hit_file->x.bam)
+   if (!seekable()) {
+      cerr << "Cannot rewind BAM input read from a stream." << endl;
+      exit(1);
+   }
+   _lookahead.clear();
+   if (_iter) {
+      bam_iter_destroy(_iter);
+      _iter = bam_iter_query(_index, _tid, _beg, _end);
+      _eof_encountered = false;
+   }
+   else if (_hit_file && _hit_file->x.bam)
    {
-      bgzf_seek(_hit_file->x.bam, _beginning, SEEK_SET);
+      if (_reader) _reader->seek(_beginning);
+      else bgzf_seek(_hit_file->x.bam, _beginning, SEEK_SET);
       _eof_encountered = false;
    }
 }
 
-void BAMHitFactory::markCurrPos()
-{
-   _curr_pos = bgzf_tell(_hit_file->x.bam);
-}
-
 int64_t BAMHitFactory::getCurrPos()
 {
+   if (_reader) return _reader->tell();
    return bgzf_tell(_hit_file->x.bam);
 }
 
 bool BAMHitFactory::recordsRemain() const{
-   return !_eof_encountered;
-}
-
-void BAMHitFactory::undo_hit(){
-   bgzf_seek(_hit_file->x.bam, _curr_pos, SEEK_SET);
+   return !_eof_encountered || !_lookahead.empty();
 }
 
 void BAMHitFactory::return2Pos(int64_t pos){
-   bgzf_seek(_hit_file->x.bam, pos, SEEK_SET);
+   assert(_iter == NULL && seekable()); // not supported in region mode or on streams
+   _lookahead.clear();
+   if (_reader) _reader->seek(pos);
+   else bgzf_seek(_hit_file->x.bam, pos, SEEK_SET);
 }
 
 bool BAMHitFactory::nextRecord(const char* &buf, size_t& buf_size)
@@ -462,11 +556,13 @@ bool BAMHitFactory::nextRecord(const char* &buf, size_t& buf_size)
       free(_next_hit.data);
       _next_hit.data=NULL;
    }
-   if (recordsRemain() == false)
+   if (_eof_encountered)
       return false;
-   markCurrPos();
    memset(&_next_hit,0,sizeof(_next_hit));
-   int bytes_read = samread(_hit_file, &_next_hit);
+   int bytes_read;
+   if (_iter) bytes_read = bam_iter_read(_hit_file->x.bam, _iter, &_next_hit);
+   else if (_reader) bytes_read = _reader->read_bam1(&_next_hit);
+   else bytes_read = samread(_hit_file, &_next_hit);
    if (bytes_read < 0){
       _eof_encountered = true;
       return false;
@@ -477,6 +573,45 @@ bool BAMHitFactory::nextRecord(const char* &buf, size_t& buf_size)
    return true;
 }
 
+static inline uint64_t mix64(uint64_t h)
+{
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdull;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ull;
+   h ^= h >> 33;
+   return h;
+}
+
+static ReadID mate_pair_key(const bam1_t* b)
+/*
+ * Key shared by both mates of a pair, computed from the BAM core fields
+ * without copying the query name: the name bytes are hashed in place a
+ * word at a time and mixed with the two (tid, pos) ends of the pair, taken
+ * in sorted order so that both mates agree. Different alignments of a
+ * multi-mapped read therefore get different keys. Never returns zero.
+ */
+{
+   const char* name = bam1_qname(b);
+   size_t len = b->core.l_qname > 0 ? b->core.l_qname - 1 : 0; // l_qname counts the NUL
+   uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+   size_t i = 0;
+   for (; i + 8 <= len; i += 8) {
+      uint64_t w;
+      memcpy(&w, name + i, 8);
+      h = (h ^ mix64(w)) * 0x100000001b3ull;
+   }
+   uint64_t tail = 0;
+   memcpy(&tail, name + i, len - i);
+   h = mix64(h ^ tail);
+
+   uint64_t self = (uint64_t)(uint32_t)b->core.tid << 32 | (uint32_t)b->core.pos;
+   uint64_t mate = (uint64_t)(uint32_t)b->core.mtid << 32 | (uint32_t)b->core.mpos;
+   if (mate < self) std::swap(self, mate);
+   h = mix64(h ^ mix64(self) ^ (mix64(mate) << 1));
+   return h ? h : 1;
+}
+
 bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
    const bam1_t* hit_buf = (const bam1_t*)orig_bwt_buf;
    uint32_t sam_flag = hit_buf->core.flag;
@@ -490,24 +625,14 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
    uint32_t qual = hit_buf->core.qual;
    int target_id = hit_buf->core.tid;
    int mate_target_id = hit_buf->core.mtid;
-   string mate_text_name;
+   RefID parterner_ref_id = tid2ref(mate_target_id);
 
-   if(mate_target_id < 0){
-      mate_text_name = "*";
-   }
-   else{
-      mate_text_name = _hit_file->header->target_name[mate_target_id];
-      //str2lower(mate_text_name);
-   }
-   RefID parterner_ref_id = ref_table().get_id(mate_text_name);
-
-   ReadID readid = HitFactory::reads_table().get_id(bam1_qname(hit_buf));
    vector<CigarOp> cigar;
    bool is_spliced_alignment = false;
    int num_hits = 1;
    if( (sam_flag & 0x4) || target_id < 0 ){ // unmapped reads
          return false;
-      bh = ReadHit(readid,
+      bh = ReadHit(mate_pair_key(hit_buf),
                    bam1_qname(hit_buf),
                    GenomicInterval(),
                    cigar,
@@ -517,7 +642,8 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
                    num_hits,
                    sam_flag,
                    0.0,
-                   NULL
+                   NULL,
+                   0
                    );
       return true;
    }
@@ -526,14 +652,11 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
       std::cerr <<"Read "<< bam1_qname(hit_buf)<< " has not reached min mapq: "<< kMinMapQual << std::endl;
    }
 
-   string text_name = _hit_file->header->target_name[target_id];
-   //str2lower(text_name);
-   RefID ref_id = ref_table().get_id(text_name);
-
    if(target_id >= _hit_file->header->n_targets){
       fprintf(stderr, "BAM error: file contains hits to sequences not in BAM file header");
       return false;
    }
+   RefID ref_id = tid2ref(target_id);
 
    int read_len = 0;
    int eff_read_len = 0;
@@ -600,15 +723,10 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
 
    if(eff_read_len <= 1 ) return false;
 
-   string mate_ref;
-
    if(sam_flag & BAM_FPAIRED) //paired-end read
    {
       SINGLE_END_EXP = false;
-      if(mate_target_id == target_id){
-         mate_ref = _hit_file->header->target_name[mate_target_id];
-      }
-      else {
+      if(mate_target_id != target_id){
          if(sam_flag & 0x8){ // next segment unmapped
             if (verbose) {
                std::cerr<<"read "<<bam1_qname(hit_buf)<<" has unmapped pair\n";
@@ -685,20 +803,9 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
 //   if(use_only_paired_hits && ( sam_flag & 0x8 || mate_target_id != target_id ))
 //      return false;
 
-   /*
-    * Get read sequencing
-    * */
-   char *qseq = (char *) malloc(hit_buf->core.l_qseq+1);
-   unsigned char *s   = bam1_seq(hit_buf);
-   int n= 0;
-   for(n = 0;n<(hit_buf->core.l_qseq);n++) {
-     int v = bam1_seqi(s,n);
-     qseq[n] = bam_nt16_rev_table[v];
-   }
-   qseq[n] = 0;
    bh = ReadHit(
-               readid,
-               bam1_qname(hit_buf),
+               mate_pair_key(hit_buf),
+               verbose ? bam1_qname(hit_buf) : "", // names are only printed in verbose logs
                GenomicInterval(ref_id, pos, pos+read_len-1, source_strand),
                cigar,
                parterner_ref_id,
@@ -707,13 +814,106 @@ bool BAMHitFactory::getHitFromBuf(const char* orig_bwt_buf, ReadHit &bh){
                num_hits,
                sam_flag,
                mass,
-               qseq
+               bam1_seq(hit_buf),
+               hit_buf->core.l_qseq
                );
-   free(qseq);
-   qseq = NULL;
    return true;
 }
 
+MergedHitFactory::MergedHitFactory(const vector<string>& bam_file_names,
+                                   ReadTable &read_table,
+                                   RefSeqTable &ref_table):
+                 HitFactory(read_table, ref_table, bam_file_names.front()),
+                 _bufs(bam_file_names.size(), NULL),
+                 _buf_sizes(bam_file_names.size(), 0)
+{
+   for (const auto &name : bam_file_names) {
+      _inputs.emplace_back(new BAMHitFactory(name, read_table, ref_table));
+   }
+}
+
+bool MergedHitFactory::inspect_header()
+{
+   bool success = true;
+   for (auto &input : _inputs) {
+      success = input->inspect_header() && success;
+   }
+   return success;
+}
+
+bool MergedHitFactory::recordsRemain() const
+{
+   return !_eof_encountered || !_lookahead.empty();
+}
+
+bool MergedHitFactory::seekable() const
+{
+   for (const auto &input : _inputs) {
+      if (!input->seekable()) return false;
+   }
+   return true;
+}
+
+void MergedHitFactory::reset()
+{
+   for (auto &input : _inputs) {
+      input->reset();
+   }
+   _lookahead.clear();
+   _heap = decltype(_heap)();
+   _last = -1;
+   _started = false;
+   _eof_encountered = false;
+}
+
+int64_t MergedHitFactory::getCurrPos()
+{
+   return -1; // a single file offset does not describe the merged position
+}
+
+void MergedHitFactory::return2Pos(int64_t pos)
+{
+   cerr << "Cannot return to a file position when reading several BAM files." << endl;
+   exit(1);
+}
+
+void MergedHitFactory::advance(size_t i)
+{
+   if (!_inputs[i]->nextRecord(_bufs[i], _buf_sizes[i])) return;
+   const bam1_t* b = (const bam1_t*)_bufs[i];
+   // unmapped records (RefID -1, pos -1) sort last
+   uint64_t key = (uint64_t)(uint32_t)_inputs[i]->target_ref_id(b->core.tid) << 32 | (uint32_t)b->core.pos;
+   _heap.push(make_pair(key, i));
+}
+
+bool MergedHitFactory::nextRecord(const char* &buf, size_t& buf_size)
+{
+   if (!_started) {
+      for (size_t i = 0; i < _inputs.size(); ++i) {
+         advance(i);
+      }
+      _started = true;
+   } else if (_last >= 0) {
+      advance(_last);
+      _last = -1;
+   }
+   if (_heap.empty()) {
+      _eof_encountered = true;
+      return false;
+   }
+   _last = _heap.top().second;
+   _heap.pop();
+   buf = _bufs[_last];
+   buf_size = _buf_sizes[_last];
+   return true;
+}
+
+bool MergedHitFactory::getHitFromBuf(const char* bwt_buf, ReadHit &bh)
+{
+   assert(_last >= 0);
+   return _inputs[_last]->getHitFromBuf(bwt_buf, bh);
+}
+
 
 PairedHit::PairedHit(ReadHitPtr leftRead, ReadHitPtr rightRead):
             _left_read(move(leftRead)), _right_read(move(rightRead))
@@ -1002,3 +1202,89 @@ void PairedHit::add_2_collapse_mass(double add){
 double PairedHit::collapse_mass() const {
    return _collapse_mass;
 }
+
+void PairedHit::add_2_collapse_count(int add){
+   _collapse_count += add;
+}
+
+int PairedHit::collapse_count() const {
+   return _collapse_count;
+}
+
+size_t PairedHitHash::operator()(const PairedHit &hit) const
+{
+   uint64_t h = (hit._left_read != nullptr) | (hit._right_read != nullptr) << 1;
+   for (ReadHitPtr r : {hit._left_read, hit._right_read}) {
+      if (r == nullptr) continue;
+      h = mix64(h ^ r->left());
+      for (const auto &op : r->cigar()) {
+         h = mix64(h ^ ((uint64_t)op._length << 4 | op._type));
+      }
+   }
+   return h;
+}
+
+static int bit_width(uint64_t x)
+{
+   int w = 0;
+   while (x >> w) ++w;
+   return w;
+}
+
+void sort_paired_hits(vector<PairedHit> &hits)
+/*
+ * PairedHit::operator< compares (left_pos(), right_pos()), each of which
+ * dereferences both mates. Read them once into one key per hit, offset by
+ * the smallest left and right ends of the cluster so that the key has as
+ * few bits as the span of the cluster needs, and LSD radix sort the
+ * (key, index) pairs a digit at a time. Every pass is stable, so hits
+ * with equal keys keep their order. The hits are moved once at the end.
+ */
+{
+   const size_t n = hits.size();
+   if (n < 2) return;
+   vector<uint32_t> lefts(n), rights(n);
+   for (size_t i = 0; i < n; ++i) {
+      lefts[i] = hits[i].left_pos();
+      rights[i] = hits[i].right_pos();
+   }
+   auto l_range = minmax_element(lefts.begin(), lefts.end());
+   auto r_range = minmax_element(rights.begin(), rights.end());
+   const uint32_t min_left = *l_range.first;
+   const uint32_t min_right = *r_range.first;
+   const int right_bits = bit_width(*r_range.second - min_right);
+   const int key_bits = bit_width(*l_range.second - min_left) + right_bits;
+
+   vector<pair<uint64_t, uint32_t>> keys(n);
+   for (size_t i = 0; i < n; ++i) {
+      keys[i].first = (uint64_t)(lefts[i] - min_left) << right_bits | (rights[i] - min_right);
+      keys[i].second = i;
+   }
+
+   const size_t kMinRadixSize = 256; // below this a comparison sort of the keys is faster
+   if (n < kMinRadixSize) {
+      sort(keys.begin(), keys.end());
+   } else {
+      const int kDigitBits = 11;
+      vector<pair<uint64_t, uint32_t>> buf(n);
+      vector<uint32_t> offsets(1 << kDigitBits);
+      for (int shift = 0; shift < key_bits; shift += kDigitBits) {
+         const uint64_t mask = (1 << kDigitBits) - 1;
+         fill(offsets.begin(), offsets.end(), 0);
+         for (const auto &k : keys) ++offsets[k.first >> shift & mask];
+         uint32_t sum = 0;
+         for (auto &o : offsets) {
+            uint32_t c = o;
+            o = sum;
+            sum += c;
+         }
+         for (const auto &k : keys) buf[offsets[k.first >> shift & mask]++] = k;
+         keys.swap(buf);
+      }
+   }
+
+   vector<PairedHit> sorted;
+   sorted.reserve(n);
+   for (const auto &k : keys) sorted.push_back(hits[k.second]);
+   hits.swap(sorted);
+}
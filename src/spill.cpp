@@ -0,0 +1,195 @@
+/*
+ * spill.cpp
+ *
+ * See spill.h.
+ */
+
+#include "spill.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+atomic<size_t> MemoryBudget::_in_use = {0};
+
+FILE* open_spill_file()
+{
+   const char* tmpdir = getenv("TMPDIR");
+   string dir = tmpdir != NULL && *tmpdir ? tmpdir : "/tmp";
+   string path = dir + "/strawberry.spill.XXXXXX";
+   vector<char> name(path.begin(), path.end());
+   name.push_back('\0');
+   int fd = mkstemp(name.data());
+   if (fd < 0) {
+      cerr << "Cannot create a spill file in " << dir << ". Set TMPDIR or raise --max-memory." << endl;
+      exit(1);
+   }
+   unlink(name.data());
+   FILE* f = fdopen(fd, "w+b");
+   if (f == NULL) {
+      cerr << "Cannot open spill file " << name.data() << endl;
+      exit(1);
+   }
+   return f;
+}
+
+static void put(FILE *out, const void *src, size_t len)
+{
+   if (fwrite(src, 1, len, out) != len) {
+      cerr << "Fail to write spill file. Is the disk of $TMPDIR full?" << endl;
+      exit(1);
+   }
+}
+
+static void get(FILE *in, void *dst, size_t len)
+{
+   if (fread(dst, 1, len, in) != len) {
+      cerr << "Spill file is truncated." << endl;
+      exit(1);
+   }
+}
+
+template<class V>
+static void put_value(FILE *out, const V &v) { put(out, &v, sizeof(v)); }
+
+template<class V>
+static V get_value(FILE *in)
+{
+   V v;
+   get(in, &v, sizeof(v));
+   return v;
+}
+
+static void put_string(FILE *out, const string &s)
+{
+   put_value<uint32_t>(out, s.size());
+   put(out, s.data(), s.size());
+}
+
+static string get_string(FILE *in)
+{
+   string s(get_value<uint32_t>(in), '\0');
+   if (!s.empty()) get(in, &s[0], s.size());
+   return s;
+}
+
+// Each feature is its offset, (length << 2 | code) and average coverage.
+static void put_feats(FILE *out, const vector<GenomicFeature> &feats)
+{
+   put_value<uint32_t>(out, feats.size());
+   for (const auto &f: feats) {
+      put_value<uint32_t>(out, f._genomic_offset);
+      put_value<uint32_t>(out, (uint32_t)f._match_op._len << 2 | f._match_op._code);
+      put_value<double>(out, f._avg_cov);
+   }
+}
+
+static vector<GenomicFeature> get_feats(FILE *in)
+{
+   vector<GenomicFeature> feats(get_value<uint32_t>(in));
+   for (auto &f: feats) {
+      uint32_t offset = get_value<uint32_t>(in);
+      uint32_t op = get_value<uint32_t>(in);
+      f = GenomicFeature((Match_t)(op & 3), offset, op >> 2);
+      f._avg_cov = get_value<double>(in);
+   }
+   return feats;
+}
+
+static size_t string_bytes(const string &s)
+{
+   return s.capacity() + 1;
+}
+
+void SpillCodec<Contig>::write(FILE *out, const Contig &contig)
+{
+   put_value(out, contig._ref_id);
+   put_value(out, contig._contig_id);
+   put_value<uint8_t>(out, static_cast<uint8_t>(contig._strand));
+   put_value<uint8_t>(out, static_cast<uint8_t>(contig._single_read_orit));
+   put_value<uint8_t>(out, contig._is_ref);
+   put_value(out, contig._mass);
+   put_string(out, contig._annotated_trans_id);
+   put_string(out, contig._parent_id);
+   put_string(out, contig._ref_gene_id);
+   put_string(out, contig._ref_gene_name);
+   put_feats(out, contig._genomic_feats);
+}
+
+Contig SpillCodec<Contig>::read(FILE *in)
+{
+   RefID ref_id = get_value<RefID>(in);
+   ReadID contig_id = get_value<ReadID>(in);
+   Strand_t strand = static_cast<Strand_t>(get_value<uint8_t>(in));
+   SingleOrit_t orit = static_cast<SingleOrit_t>(get_value<uint8_t>(in));
+   bool is_ref = get_value<uint8_t>(in);
+   double mass = get_value<double>(in);
+   string annotated_trans_id = get_string(in);
+   string parent_id = get_string(in);
+   string ref_gene_id = get_string(in);
+   string ref_gene_name = get_string(in);
+   Contig contig(ref_id, contig_id, strand, mass, get_feats(in), is_ref);
+   contig._single_read_orit = orit;
+   contig._annotated_trans_id = move(annotated_trans_id);
+   contig._parent_id = move(parent_id);
+   contig._ref_gene_id = move(ref_gene_id);
+   contig._ref_gene_name = move(ref_gene_name);
+   return contig;
+}
+
+size_t SpillCodec<Contig>::mem_size(const Contig &contig)
+{
+   return sizeof(Contig) + contig._genomic_feats.capacity() * sizeof(GenomicFeature) +
+          string_bytes(contig._annotated_trans_id) + string_bytes(contig._parent_id) +
+          string_bytes(contig._ref_gene_id) + string_bytes(contig._ref_gene_name);
+}
+
+void SpillCodec<Isoform>::write(FILE *out, const Isoform &iso)
+{
+   SpillCodec<Contig>::write(out, iso._contig);
+   put_value(out, iso._isoform_id);
+   put_value(out, iso._length);
+   put_feats(out, iso._exon_segs);
+   put_string(out, iso._isoform_str);
+   put_string(out, iso._gene_str);
+   put_string(out, iso._ref_gene_id);
+   put_string(out, iso._ref_gene_name);
+   put_value(out, iso._bais_factor);
+   put_value(out, iso._frac);
+   put_value(out, iso._FPKM);
+   put_value(out, iso._TPM);
+   put_string(out, iso._frac_s);
+   put_string(out, iso._FPKM_s);
+   put_string(out, iso._TPM_s);
+}
+
+Isoform SpillCodec<Isoform>::read(FILE *in)
+{
+   Contig contig = SpillCodec<Contig>::read(in);
+   Isoform iso(vector<GenomicFeature>(), move(contig), "", "", "", "");
+   iso._isoform_id = get_value<int>(in);
+   iso._length = get_value<int>(in);
+   iso._exon_segs = get_feats(in);
+   iso._isoform_str = get_string(in);
+   iso._gene_str = get_string(in);
+   iso._ref_gene_id = get_string(in);
+   iso._ref_gene_name = get_string(in);
+   iso._bais_factor = get_value<double>(in);
+   iso._frac = get_value<double>(in);
+   iso._FPKM = get_value<double>(in);
+   iso._TPM = get_value<double>(in);
+   iso._frac_s = get_string(in);
+   iso._FPKM_s = get_string(in);
+   iso._TPM_s = get_string(in);
+   return iso;
+}
+
+size_t SpillCodec<Isoform>::mem_size(const Isoform &iso)
+{
+   return sizeof(Isoform) - sizeof(Contig) + SpillCodec<Contig>::mem_size(iso._contig) +
+          iso._exon_segs.capacity() * sizeof(GenomicFeature) +
+          string_bytes(iso._isoform_str) + string_bytes(iso._gene_str) +
+          string_bytes(iso._ref_gene_id) + string_bytes(iso._ref_gene_name) +
+          string_bytes(iso._frac_s) + string_bytes(iso._FPKM_s) + string_bytes(iso._TPM_s);
+}